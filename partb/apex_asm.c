@@ -0,0 +1,34 @@
+/*
+ *  apex_asm.c
+ *  Assembles an APEX .asm file into a binary program image that
+ *  apex_sim maps directly as code memory
+ *
+ *  Usage : apex-asm <input_file> <image_file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char** argv)
+{
+  if (argc != 3) {
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> <image_file>\n", argv[0]);
+    exit(1);
+  }
+
+  int size;
+  APEX_Instruction* code_memory = create_code_memory(argv[1], &size, stderr);
+  if (!code_memory) {
+    fprintf(stderr, "APEX_Error : Unable to read %s\n", argv[1]);
+    exit(1);
+  }
+  if (write_code_image(argv[2], code_memory, size) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write %s\n", argv[2]);
+    free(code_memory);
+    exit(1);
+  }
+  free(code_memory);
+  return 0;
+}
@@ -0,0 +1,361 @@
+/*
+ *  apex_batch.c
+ *  Runs a manifest of simulation jobs across all cores. Jobs are dealt
+ *  round-robin onto per-worker deques; a worker takes jobs from the back
+ *  of its own deque and, once that is empty, steals from the front of
+ *  the others'. Every distinct program is parsed once and shared by all
+ *  jobs running it; every worker simulates on its own APEX_CPU, reset
+ *  between jobs, so workers share nothing mutable but the deques and the
+ *  result array.
+ *
+ *  Usage : apex_batch [-j threads] <manifest>
+ *
+ *  Manifest lines are "<program> <mode> [budget]", with mode one of
+ *  simulate, functional, threaded or block and budget a cycle count (or
+ *  an instruction count for the functional modes). Blank lines and lines
+ *  starting with # are ignored.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cpu.h"
+
+static const struct
+{
+  const char* name;
+  int mode;
+} modes[] = {
+  { "simulate", 0 },
+  { "functional", 2 },
+  { "threaded", 3 },
+  { "block", 4 },
+};
+
+typedef struct Batch_Job
+{
+  char* program;
+  APEX_Program* code;	// Shared with every job running the same program
+  int mode;
+  long long budget;
+
+  /* Results, written by the worker that ran the job */
+  int status;	        // 0 ok, -1 if the program could not be loaded
+  long long cycles;
+  long long ins_completed;
+  int finished;
+  unsigned int mem_checksum;	// data_memory_checksum of the final memory
+  int regs[32];
+} Batch_Job;
+
+/* Deque of job indices owned by one worker */
+typedef struct Job_Deque
+{
+  pthread_mutex_t lock;
+  int* jobs;
+  int head;	    // Next job to steal
+  int tail;	    // One past the next job to pop
+} Job_Deque;
+
+typedef struct Batch_Pool
+{
+  Batch_Job* jobs;
+  Job_Deque* deques;
+  int num_workers;
+} Batch_Pool;
+
+typedef struct Batch_Worker
+{
+  Batch_Pool* pool;
+  int id;
+} Batch_Worker;
+
+static int
+pop_job(Job_Deque* deque)
+{
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail > deque->head) {
+    job = deque->jobs[--deque->tail];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+static int
+steal_job(Job_Deque* deque)
+{
+  int job = -1;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->tail > deque->head) {
+    job = deque->jobs[deque->head++];
+  }
+  pthread_mutex_unlock(&deque->lock);
+  return job;
+}
+
+/*
+ * Returns the next job for worker id, or -1 once every deque is empty.
+ * No jobs are added after startup, so one empty sweep means done.
+ */
+static int
+next_job(Batch_Pool* pool, int id)
+{
+  int job = pop_job(&pool->deques[id]);
+  for (int i = 1; job < 0 && i < pool->num_workers; ++i) {
+    job = steal_job(&pool->deques[(id + i) % pool->num_workers]);
+  }
+  return job;
+}
+
+static void
+run_job(APEX_CPU* cpu, Batch_Job* job)
+{
+  if (!job->code) {
+    job->status = -1;
+    return;
+  }
+  APEX_cpu_attach(cpu, job->code);
+  APEX_cpu_reset(cpu);
+
+  switch (job->mode) {
+    case 0:
+      APEX_cpu_step(cpu, job->budget);
+      break;
+
+    case 2:
+      APEX_functional_run(cpu, job->budget);
+      break;
+
+    case 3:
+      APEX_threaded_run(cpu, job->budget);
+      break;
+
+    case 4:
+      APEX_block_run(cpu, job->budget);
+      break;
+  }
+
+  job->status = 0;
+  job->cycles = cpu->clock - 1;
+  job->ins_completed = cpu->ins_completed;
+  job->finished = APEX_cpu_finished(cpu);
+  job->mem_checksum = data_memory_checksum(cpu);
+  for (int i = 0; i < 32; ++i) {
+    APEX_cpu_read_reg(cpu, i, &job->regs[i]);
+  }
+}
+
+static void*
+worker_main(void* arg)
+{
+  Batch_Worker* worker = arg;
+  Batch_Pool* pool = worker->pool;
+
+  APEX_Config config = { .trace = 0, .cycle_budget = LLONG_MAX };
+  APEX_CPU* cpu = APEX_cpu_create(&config);
+
+  int job;
+  while ((job = next_job(pool, worker->id)) >= 0) {
+    if (cpu) {
+      run_job(cpu, &pool->jobs[job]);
+    }
+    else {
+      pool->jobs[job].status = -1;
+    }
+  }
+  if (cpu) {
+    APEX_cpu_stop(cpu);
+  }
+  return NULL;
+}
+
+/*
+ * Returns the program named filename, loading it unless an earlier job
+ * already did. A program that fails to load is retried by every job
+ * naming it, and each of those jobs reports an error.
+ */
+static APEX_Program*
+find_program(Batch_Job* jobs, int count, const char* filename)
+{
+  for (int i = 0; i < count; ++i) {
+    if (jobs[i].code && strcmp(jobs[i].program, filename) == 0) {
+      return APEX_program_retain(jobs[i].code);
+    }
+  }
+  return APEX_program_load(filename, stderr);
+}
+
+/*
+ * Reads the manifest into a job array.
+ *
+ * Returns the number of jobs, or -1 on a malformed line
+ */
+static int
+read_manifest(const char* filename, Batch_Job** jobs)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    return -1;
+  }
+
+  char* line = NULL;
+  size_t len = 0;
+  int line_num = 0;
+  int count = 0;
+  int capacity = 64;
+  *jobs = malloc(sizeof(**jobs) * capacity);
+
+  while (*jobs && getline(&line, &len, fp) != -1) {
+    line_num++;
+    char* program = strtok(line, " \t\r\n");
+    if (!program || program[0] == '#') {
+      continue;
+    }
+    char* mode_name = strtok(NULL, " \t\r\n");
+    char* budget = strtok(NULL, " \t\r\n");
+
+    int mode = -1;
+    for (int i = 0; mode_name && i < sizeof(modes) / sizeof(modes[0]); ++i) {
+      if (strcmp(mode_name, modes[i].name) == 0) {
+        mode = modes[i].mode;
+      }
+    }
+    if (mode < 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: expected a mode\n", filename,
+              line_num);
+      count = -1;
+      break;
+    }
+
+    if (count == capacity) {
+      capacity *= 2;
+      Batch_Job* grown = realloc(*jobs, sizeof(**jobs) * capacity);
+      if (!grown) {
+        count = -1;
+        break;
+      }
+      *jobs = grown;
+    }
+    Batch_Job* job = &(*jobs)[count++];
+    memset(job, 0, sizeof(*job));
+    job->program = strdup(program);
+    job->code = find_program(*jobs, count - 1, program);
+    job->mode = mode;
+    job->budget = LLONG_MAX;
+    if (budget && parse_count(budget, &job->budget) != 0) {
+      fprintf(stderr, "APEX_Error : %s:%d: invalid budget\n", filename,
+              line_num);
+      count = -1;
+      break;
+    }
+  }
+  free(line);
+  fclose(fp);
+  if (!*jobs) {
+    return -1;
+  }
+  return count;
+}
+
+static const char*
+mode_name(int mode)
+{
+  for (int i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+    if (modes[i].mode == mode) {
+      return modes[i].name;
+    }
+  }
+  return "";
+}
+
+int
+main(int argc, char** argv)
+{
+  int num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int arg = 1;
+  if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+    num_workers = atoi(argv[2]);
+    arg = 3;
+  }
+  if (arg >= argc) {
+    fprintf(stderr, "APEX_Help : Usage %s [-j threads] <manifest>\n", argv[0]);
+    exit(1);
+  }
+  if (num_workers < 1) {
+    num_workers = 1;
+  }
+
+  Batch_Job* jobs;
+  int num_jobs = read_manifest(argv[arg], &jobs);
+  if (num_jobs < 0) {
+    fprintf(stderr, "APEX_Error : Unable to read manifest %s\n", argv[arg]);
+    exit(1);
+  }
+  if (num_workers > num_jobs && num_jobs > 0) {
+    num_workers = num_jobs;
+  }
+
+  /* Deal the jobs round-robin so that every worker starts busy */
+  Batch_Pool pool = { jobs, calloc(num_workers, sizeof(Job_Deque)), num_workers };
+  Batch_Worker* workers = calloc(num_workers, sizeof(Batch_Worker));
+  pthread_t* threads = calloc(num_workers, sizeof(pthread_t));
+  if (!pool.deques || !workers || !threads) {
+    fprintf(stderr, "APEX_Error : Unable to allocate the worker pool\n");
+    exit(1);
+  }
+  for (int w = 0; w < num_workers; ++w) {
+    Job_Deque* deque = &pool.deques[w];
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->jobs = malloc(sizeof(int) * (num_jobs / num_workers + 1));
+    if (!deque->jobs) {
+      fprintf(stderr, "APEX_Error : Unable to allocate the worker pool\n");
+      exit(1);
+    }
+  }
+  for (int j = 0; j < num_jobs; ++j) {
+    Job_Deque* deque = &pool.deques[j % num_workers];
+    deque->jobs[deque->tail++] = j;
+  }
+
+  for (int w = 0; w < num_workers; ++w) {
+    workers[w].pool = &pool;
+    workers[w].id = w;
+    if (pthread_create(&threads[w], NULL, worker_main, &workers[w]) != 0) {
+      fprintf(stderr, "APEX_Error : Unable to start worker %d\n", w);
+      exit(1);
+    }
+  }
+  for (int w = 0; w < num_workers; ++w) {
+    pthread_join(threads[w], NULL);
+  }
+
+  /* One line per job, in manifest order */
+  printf("# job program mode budget status cycles ins_completed finished "
+         "mem_checksum R0..R31\n");
+  for (int j = 0; j < num_jobs; ++j) {
+    Batch_Job* job = &jobs[j];
+    printf("%d %s %s %lld %s %lld %lld %d %08x", j, job->program,
+           mode_name(job->mode), job->budget, job->status ? "error" : "ok",
+           job->cycles, job->ins_completed, job->finished, job->mem_checksum);
+    for (int i = 0; i < 32; ++i) {
+      printf(" %d", job->regs[i]);
+    }
+    printf("\n");
+    free(job->program);
+    APEX_program_release(job->code);
+  }
+
+  for (int w = 0; w < num_workers; ++w) {
+    pthread_mutex_destroy(&pool.deques[w].lock);
+    free(pool.deques[w].jobs);
+  }
+  free(pool.deques);
+  free(workers);
+  free(threads);
+  free(jobs);
+  return 0;
+}
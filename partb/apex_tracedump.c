@@ -0,0 +1,36 @@
+/*
+ *  apex_tracedump.c
+ *  Prints a binary pipeline trace written by apex_sim -t, either as the
+ *  text display mode prints or as CSV
+ *
+ *  Usage : apex_tracedump [-c] <trace_file>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+int
+main(int argc, char** argv)
+{
+  int csv = argc == 3 && strcmp(argv[1], "-c") == 0;
+  if (argc != 2 + csv) {
+    fprintf(stderr, "APEX_Help : Usage %s [-c] <trace_file>\n", argv[0]);
+    exit(1);
+  }
+
+  const char* filename = argv[1 + csv];
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "APEX_Error : Unable to read %s\n", filename);
+    exit(1);
+  }
+  if (APEX_trace_decode(fp, stdout, csv) != 0) {
+    fprintf(stderr, "APEX_Error : %s is not a valid trace\n", filename);
+    fclose(fp);
+    exit(1);
+  }
+  fclose(fp);
+  return 0;
+}
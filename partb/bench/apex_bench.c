@@ -0,0 +1,243 @@
+/*
+ *  apex_bench.c
+ *  Host-throughput benchmark: runs each kernel in every engine mode and
+ *  prints one CSV row per kernel and mode with the simulated cycles per
+ *  host second, instructions per host second and peak resident set size.
+ *  Every kernel and mode runs in a child process of its own, so the peak
+ *  RSS is that of the run alone, and is repeated until it has taken at
+ *  least the minimum time; the rates are over all repetitions.
+ *
+ *  The functional engines model no timing, so their cycle columns are 0;
+ *  the sampled mode reports its estimated cycles.
+ *
+ *  Usage : apex_bench [-t min_seconds] [-b budget] <kernel.asm>...
+ *
+ *  budget bounds every run, in cycles for the pipeline modes and in
+ *  instructions for the others; by default kernels run to completion.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../cpu.h"
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const struct
+{
+  const char* name;
+  int mode;
+} modes[] = {
+  { "simulate", 0 },
+  { "display", 1 },
+  { "functional", 2 },
+  { "threaded", 3 },
+  { "block", 4 },
+  { "sample", 5 },
+};
+
+/* Totals over the repetitions of one kernel and mode, sent by the child */
+typedef struct Bench_Result
+{
+  int status;	        // 0 ok, -1 if the kernel could not be loaded
+  int runs;
+  long long cycles;
+  long long instructions;
+  double seconds;
+} Bench_Result;
+
+/* Runs the attached program once; returns its cycles and instructions */
+static void
+run_once(APEX_CPU* cpu, int mode, long long budget, long long* cycles,
+         long long* instructions)
+{
+  APEX_Sample_Result sample;
+
+  APEX_cpu_reset(cpu);
+  switch (mode) {
+    case 0:
+    case 1:
+      APEX_cpu_step(cpu, budget);
+      APEX_trace_flush(cpu);
+      *cycles = cpu->clock - 1;
+      *instructions = cpu->counters.committed;
+      break;
+
+    case 2:
+      *cycles = 0;
+      *instructions = APEX_functional_run(cpu, budget);
+      break;
+
+    case 3:
+      *cycles = 0;
+      *instructions = APEX_threaded_run(cpu, budget);
+      break;
+
+    case 4:
+      *cycles = 0;
+      *instructions = APEX_block_run(cpu, budget);
+      break;
+
+    default:
+      APEX_sample_run(cpu, budget, &sample);
+      *cycles = (long long)(sample.cpi * sample.instructions + 0.5);
+      *instructions = sample.instructions;
+      break;
+  }
+}
+
+static Bench_Result
+bench_kernel(const char* kernel, int mode, double min_seconds,
+             long long budget, FILE* sink)
+{
+  Bench_Result result = { .status = -1 };
+  APEX_Program* program = APEX_program_load(kernel, stderr);
+  if (!program) {
+    return result;
+  }
+  APEX_Config config = {
+    .trace = mode == 1,
+    .out = sink,
+    .err = stderr,
+    .cycle_budget = LLONG_MAX,
+  };
+  APEX_CPU* cpu = APEX_cpu_create(&config);
+  if (!cpu) {
+    APEX_program_release(program);
+    return result;
+  }
+  APEX_cpu_attach(cpu, program);
+  APEX_program_release(program);
+
+  result.status = 0;
+  do {
+    long long cycles, instructions;
+    double start = now();
+    run_once(cpu, mode, budget, &cycles, &instructions);
+    result.seconds += now() - start;
+    result.cycles += cycles;
+    result.instructions += instructions;
+    result.runs++;
+  } while (result.seconds < min_seconds);
+
+  APEX_cpu_stop(cpu);
+  return result;
+}
+
+/*
+ * Benchmarks one kernel and mode in a child process and prints its row.
+ *
+ * Returns 0 on success, -1 if the child failed
+ */
+static int
+bench_in_child(const char* kernel, int m, double min_seconds,
+               long long budget, FILE* sink)
+{
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return -1;
+  }
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    Bench_Result result =
+      bench_kernel(kernel, modes[m].mode, min_seconds, budget, sink);
+    int ok = write(fds[1], &result, sizeof(result)) == sizeof(result);
+    _exit(ok ? 0 : 1);
+  }
+
+  close(fds[1]);
+  Bench_Result result;
+  int got = read(fds[0], &result, sizeof(result)) == sizeof(result);
+  close(fds[0]);
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) ||
+      WEXITSTATUS(status) != 0 || !got || result.status != 0) {
+    return -1;
+  }
+  long peak_kb = usage.ru_maxrss;
+#ifdef __APPLE__
+  peak_kb /= 1024; // ru_maxrss is in bytes on macOS
+#endif
+
+  const char* name = strrchr(kernel, '/') ? strrchr(kernel, '/') + 1 : kernel;
+  int len = strlen(name);
+  if (len > 4 && strcmp(name + len - 4, ".asm") == 0) {
+    len -= 4;
+  }
+  printf("%.*s,%s,%d,%lld,%lld,%.6f,%.0f,%.0f,%ld\n", len, name,
+         modes[m].name, result.runs, result.cycles / result.runs,
+         result.instructions / result.runs, result.seconds / result.runs,
+         result.cycles / result.seconds, result.instructions / result.seconds,
+         peak_kb);
+  return 0;
+}
+
+int
+main(int argc, char** argv)
+{
+  double min_seconds = 0.5;
+  long long budget = LLONG_MAX;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:b:")) != -1) {
+    switch (opt) {
+      case 't':
+        min_seconds = atof(optarg);
+        break;
+
+      case 'b':
+        budget = atoll(optarg);
+        break;
+
+      default:
+        optind = argc + 1;
+        break;
+    }
+  }
+  if (optind >= argc || budget <= 0) {
+    fprintf(stderr,
+            "APEX_Help : Usage %s [-t min_seconds] [-b budget] <kernel.asm>...\n",
+            argv[0]);
+    exit(1);
+  }
+
+  /* The display trace is formatted in full but thrown away */
+  FILE* sink = fopen("/dev/null", "w");
+  if (!sink) {
+    fprintf(stderr, "APEX_Error : Unable to open /dev/null\n");
+    exit(1);
+  }
+
+  int failed = 0;
+  printf("kernel,mode,runs,cycles,instructions,seconds,cycles_per_sec,"
+         "instructions_per_sec,peak_rss_kb\n");
+  for (int k = optind; k < argc; ++k) {
+    for (int m = 0; m < sizeof(modes) / sizeof(modes[0]); ++m) {
+      if (bench_in_child(argv[k], m, min_seconds, budget, sink) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to benchmark %s in %s mode\n",
+                argv[k], modes[m].name);
+        failed = 1;
+      }
+    }
+  }
+  fclose(sink);
+  return failed;
+}
@@ -0,0 +1,66 @@
+/*
+ *  engine_bench.c
+ *  Measures simulated instructions per second of the functional engines
+ *
+ *  Usage : engine_bench <input_file> [repeat]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#include "../cpu.h"
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static const struct
+{
+  const char* name;
+  long long (*run)(APEX_CPU* cpu, long long count);
+} engines[] = {
+  { "switch", APEX_functional_run },
+  { "threaded", APEX_threaded_run },
+  { "block", APEX_block_run },
+};
+
+int
+main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "APEX_Help : Usage %s <input_file> [repeat]\n", argv[0]);
+    exit(1);
+  }
+  int repeat = argc >= 3 ? atoi(argv[2]) : 5;
+
+  APEX_Config config = { .trace = 0, .out = stdout, .err = stderr,
+                         .cycle_budget = LLONG_MAX };
+  printf("%-9s %12s %10s %10s\n", "engine", "instructions", "seconds", "MIPS");
+  for (int e = 0; e < sizeof(engines) / sizeof(engines[0]); ++e) {
+    double best = 0;
+    long long instructions = 0;
+    for (int r = 0; r < repeat; ++r) {
+      APEX_CPU* cpu = APEX_cpu_create(&config);
+      if (!cpu || APEX_cpu_load(cpu, argv[1]) != 0) {
+        fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
+        exit(1);
+      }
+      double start = now();
+      instructions = engines[e].run(cpu, LLONG_MAX);
+      double elapsed = now() - start;
+      if (r == 0 || elapsed < best) {
+        best = elapsed;
+      }
+      APEX_cpu_stop(cpu);
+    }
+    printf("%-9s %12lld %10.4f %10.1f\n",
+           engines[e].name, instructions, best, instructions / best / 1e6);
+  }
+  return 0;
+}
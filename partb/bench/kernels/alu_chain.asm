@@ -0,0 +1,13 @@
+MOVC,R1,#100000
+MOVC,R2,#1
+MOVC,R3,#0
+ADD,R3,R3,R2
+ADD,R4,R3,R2
+MUL,R5,R4,R2
+AND,R6,R5,R4
+OR,R7,R6,R3
+EX-OR,R8,R7,R5
+ADD,R3,R8,R2
+SUBL,R1,R1,#1
+BNZ,#-32
+HALT
@@ -0,0 +1,7 @@
+MOVC,R1,#3000
+MOVC,R2,#100
+SUBL,R2,R2,#1
+BNZ,#-4
+SUBL,R1,R1,#1
+BNZ,#-16
+HALT
@@ -0,0 +1,16 @@
+MOVC,R1,#100000
+MOVC,R0,#0
+MOVC,R7,#0
+MOVC,R8,#0
+JUMP,R0,#4032
+ADDL,R7,R7,#1
+ADDL,R7,R7,#1
+ADDL,R7,R7,#1
+ADDL,R8,R8,#1
+JUMP,R0,#4052
+ADDL,R7,R7,#1
+ADDL,R7,R7,#1
+ADDL,R7,R7,#1
+SUBL,R1,R1,#1
+BNZ,#-40
+HALT
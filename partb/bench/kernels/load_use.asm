@@ -0,0 +1,12 @@
+MOVC,R0,#0
+MOVC,R1,#100000
+MOVC,R2,#1
+STORE,R2,R0,#0
+LOAD,R3,R0,#0
+ADD,R4,R3,R2
+STORE,R4,R0,#0
+LOAD,R5,R0,#0
+ADD,R6,R5,R4
+SUBL,R1,R1,#1
+BNZ,#-24
+HALT
@@ -0,0 +1,24 @@
+MOVC,R0,#0
+MOVC,R9,#20
+MOVC,R11,#2048
+MOVC,R5,#0
+MOVC,R1,#2048
+MOVC,R2,#0
+STORE,R1,R2,#0
+STR,R1,R2,R11
+ADDL,R2,R2,#1
+SUBL,R1,R1,#1
+BNZ,#-16
+MOVC,R1,#2048
+MOVC,R2,#0
+LDR,R4,R2,R0
+LDR,R6,R2,R11
+ADD,R5,R5,R4
+ADD,R5,R5,R6
+ADDL,R2,R2,#1
+SUBL,R1,R1,#1
+BNZ,#-24
+SUBL,R9,R9,#1
+BNZ,#-68
+STORE,R5,R0,#0
+HALT
@@ -0,0 +1,378 @@
+/*
+ *  stage_bench.c
+ *  Times the pipeline stage functions one at a time on synthetic latch
+ *  contents. Before every call of a stage the latches and the state it
+ *  may change (pc, scoreboard, Z flag, code size) are restored, so each
+ *  call sees the same input; the cost of that restore, measured the same
+ *  way around an empty stage, is subtracted. The comparator changes
+ *  nothing and is timed without the restore.
+ *
+ *  Every scenario is warmed up for one untimed repetition, then timed
+ *  over repetitions of iterations calls each; the minimum, median, mean
+ *  and standard deviation of the ns per call are printed.
+ *
+ *  Usage : stage_bench [iterations] [repetitions]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+
+#include "../cpu.h"
+
+#define MAX_REPETITIONS 1000
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void
+set_latch(CPU_Stage* stage, int op, int op_class, int rd, int rs1, int rs2, int rs3)
+{
+  memset(stage, 0, sizeof(*stage));
+  stage->pc = 4000;
+  stage->op = op;
+  stage->op_class = op_class;
+  stage->rd = rd;
+  stage->rs1 = rs1;
+  stage->rs2 = rs2;
+  stage->rs3 = rs3;
+  stage->buffer = 7;
+}
+
+/* Code memory fetched from, a short ALU loop */
+static APEX_Instruction code[] = {
+  { OP_MOVC, OPC_ALU_FWD, 1, 0, 0, 0, 5 },
+  { OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 2, 1, 1, 0, 0 },
+  { OP_SUBL, OPC_ALU_FWD | OPC_Z_FWD, 1, 1, 0, 0, 1 },
+  { OP_BNZ, 0, 0, 0, 0, 0, -8 },
+  { OP_HALT, 0, 0, 0, 0, 0, 0 },
+};
+
+/* Fetch of a free latch, reading code memory and advancing the pc */
+static void
+setup_fetch_advance(APEX_CPU* cpu)
+{
+  cpu->pc = 4004;
+}
+
+/* Fetch held by a stalled decode */
+static void
+setup_fetch_stalled(APEX_CPU* cpu)
+{
+  cpu->pc = 4008;
+  set_latch(&cpu->stage[F], OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 2, 1, 1, 0);
+  cpu->stage[F].busy = 1;
+  cpu->stage[F].stalled = 1;
+}
+
+/* ADD whose sources are both forwarded, from MEM1 and MEM2 */
+static void
+setup_add_forwarded(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[DRF], OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 3, 1, 2, 0);
+  set_latch(&cpu->stage[MEM1], OP_MOVC, OPC_ALU_FWD, 1, 0, 0, 0);
+  set_latch(&cpu->stage[MEM2], OP_MOVC, OPC_ALU_FWD, 2, 0, 0, 0);
+  cpu->regs_pending = (1u << 1) | (1u << 2);
+}
+
+/* STR whose three sources all come from the register file */
+static void
+setup_str_regfile(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[DRF], OP_STR, 0, 0, 4, 5, 6);
+}
+
+/* LOAD stalled on a source that is still in EX2 */
+static void
+setup_load_stalled(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[DRF], OP_LOAD, OPC_LOAD_FWD, 8, 7, 0, 0);
+  set_latch(&cpu->stage[EX2], OP_ADDL, OPC_ALU_FWD, 7, 0, 0, 0);
+  cpu->regs_pending = 1u << 7;
+}
+
+/* BNZ taking the Z flag forwarded from MEM1 */
+static void
+setup_bnz_forwarded(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[DRF], OP_BNZ, 0, 0, 0, 0, 0);
+  set_latch(&cpu->stage[MEM1], OP_SUBL, OPC_ALU_FWD | OPC_Z_FWD, 1, 1, 0, 0);
+}
+
+/* ADD computing its result */
+static void
+setup_ex2_add(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[EX2], OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 3, 1, 2, 0);
+  cpu->stage[EX2].rs1_value = 3;
+  cpu->stage[EX2].rs2_value = 4;
+}
+
+/* BNZ taken, squashing the three instructions behind it */
+static void
+setup_ex2_bnz_taken(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[EX2], OP_BNZ, 0, 0, 0, 0, 0);
+  cpu->stage[EX2].pc = 4012;
+  cpu->stage[EX2].imm = -8;
+  cpu->stage[EX2].z_valid = 1;
+  set_latch(&cpu->stage[EX1], OP_HALT, 0, 0, 0, 0, 0);
+  set_latch(&cpu->stage[DRF], OP_MOVC, OPC_ALU_FWD, 1, 0, 0, 0);
+  set_latch(&cpu->stage[F], OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 2, 1, 1, 0);
+  cpu->pc = 4024;
+}
+
+/* LOAD reading an allocated data memory page */
+static void
+setup_mem2_load(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[MEM2], OP_LOAD, OPC_LOAD_FWD, 8, 7, 0, 0);
+  cpu->stage[MEM2].mem_address = 16;
+  write_data_memory(cpu, 16, 42);
+}
+
+/* STORE writing an allocated data memory page */
+static void
+setup_mem2_store(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[MEM2], OP_STORE, 0, 0, 4, 5, 0);
+  cpu->stage[MEM2].mem_address = 16;
+  cpu->stage[MEM2].rs1_value = 42;
+  write_data_memory(cpu, 16, 42);
+}
+
+/* ADD retiring, setting the Z flag */
+static void
+setup_wb_add(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[WB], OP_ADD, OPC_ALU_FWD | OPC_Z_FWD, 3, 1, 2, 0);
+  cpu->regs_pending = 1u << 3;
+}
+
+/* LOAD retiring */
+static void
+setup_wb_load(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[WB], OP_LOAD, OPC_LOAD_FWD, 8, 7, 0, 0);
+  cpu->regs_pending = 1u << 8;
+}
+
+/* Register with a forwardable value in MEM1 */
+static void
+setup_comparator_hit(APEX_CPU* cpu)
+{
+  set_latch(&cpu->stage[MEM1], OP_MOVC, OPC_ALU_FWD, 1, 0, 0, 0);
+  cpu->fwd[1] = MEM1;
+}
+
+/* Register with no forwardable value */
+static void
+setup_comparator_miss(APEX_CPU* cpu)
+{
+}
+
+static int
+compare_r1(APEX_CPU* cpu)
+{
+  int value;
+  return comparator(cpu, 1, &value);
+}
+
+/* Calibration stage: the loop and restore without any work */
+static int
+empty_stage(APEX_CPU* cpu)
+{
+  return 0;
+}
+
+static const struct
+{
+  const char* stage;
+  const char* name;
+  int (*run)(APEX_CPU* cpu);
+  void (*setup)(APEX_CPU* cpu);
+  int restore;	        // Restore the state before every call
+} scenarios[] = {
+  { "fetch", "advance", fetch, setup_fetch_advance, 1 },
+  { "fetch", "stalled", fetch, setup_fetch_stalled, 1 },
+  { "decode", "add-forwarded", decode, setup_add_forwarded, 1 },
+  { "decode", "str-regfile", decode, setup_str_regfile, 1 },
+  { "decode", "load-stalled", decode, setup_load_stalled, 1 },
+  { "decode", "bnz-forwarded", decode, setup_bnz_forwarded, 1 },
+  { "execute2", "add", execute2, setup_ex2_add, 1 },
+  { "execute2", "bnz-taken", execute2, setup_ex2_bnz_taken, 1 },
+  { "memory2", "load", memory2, setup_mem2_load, 1 },
+  { "memory2", "store", memory2, setup_mem2_store, 1 },
+  { "writeback", "add", writeback, setup_wb_add, 1 },
+  { "writeback", "load", writeback, setup_wb_load, 1 },
+  { "comparator", "hit", compare_r1, setup_comparator_hit, 0 },
+  { "comparator", "miss", compare_r1, setup_comparator_miss, 0 },
+};
+
+/* Everything a stage call may change, restored before every call */
+typedef struct Stage_State
+{
+  CPU_Stage stage[NUM_STAGES];
+  unsigned int regs_pending;
+  unsigned int regs_written;
+  int pc;
+  int z;
+  int z_valid;
+  int code_memory_size;
+  int end;
+} Stage_State;
+
+static void
+save_state(const APEX_CPU* cpu, Stage_State* state)
+{
+  memcpy(state->stage, cpu->stage, sizeof(state->stage));
+  state->regs_pending = cpu->regs_pending;
+  state->regs_written = cpu->regs_written;
+  state->pc = cpu->pc;
+  state->z = cpu->z;
+  state->z_valid = cpu->z_valid;
+  state->code_memory_size = cpu->code_memory_size;
+  state->end = cpu->end;
+}
+
+static inline void
+restore_state(APEX_CPU* cpu, const Stage_State* state)
+{
+  memcpy(cpu->stage, state->stage, sizeof(state->stage));
+  cpu->regs_pending = state->regs_pending;
+  cpu->regs_written = state->regs_written;
+  cpu->pc = state->pc;
+  cpu->z = state->z;
+  cpu->z_valid = state->z_valid;
+  cpu->code_memory_size = state->code_memory_size;
+  cpu->end = state->end;
+}
+
+static void
+setup_scenario(APEX_CPU* cpu, void (*setup)(APEX_CPU* cpu))
+{
+  memset(cpu->stage, 0, sizeof(cpu->stage));
+  memset(cpu->fwd, 0, sizeof(cpu->fwd));
+  cpu->fwd_z = 0;
+  cpu->regs_pending = 0;
+  cpu->regs_written = ~0u;
+  cpu->pc = 4000;
+  cpu->z = 0;
+  cpu->z_valid = 0;
+  cpu->code_memory_size = sizeof(code) / sizeof(code[0]);
+  cpu->end = 0;
+  if (setup) {
+    setup(cpu);
+  }
+}
+
+/* Seconds taken by iterations calls of run, restoring state before each
+ * unless it is NULL */
+static double
+time_calls(APEX_CPU* cpu, int (*run)(APEX_CPU* cpu), const Stage_State* state,
+           long iterations)
+{
+  double start = now();
+  if (state) {
+    for (long i = 0; i < iterations; ++i) {
+      restore_state(cpu, state);
+      run(cpu);
+    }
+  }
+  else {
+    for (long i = 0; i < iterations; ++i) {
+      run(cpu);
+    }
+  }
+  return now() - start;
+}
+
+static int
+compare_double(const void* a, const void* b)
+{
+  double da = *(const double*)a;
+  double db = *(const double*)b;
+  return da < db ? -1 : da > db;
+}
+
+/*
+ * Times repetitions runs of the scenario after one warm-up run, leaving
+ * the ns per call of each, less overhead, sorted in ns[]
+ */
+static void
+measure(APEX_CPU* cpu, int (*run)(APEX_CPU* cpu), void (*setup)(APEX_CPU* cpu),
+        int restore, long iterations, int repetitions, double overhead,
+        double* ns)
+{
+  Stage_State state;
+  setup_scenario(cpu, setup);
+  save_state(cpu, &state);
+  const Stage_State* restored = restore ? &state : NULL;
+  time_calls(cpu, run, restored, iterations);
+  for (int r = 0; r < repetitions; ++r) {
+    ns[r] = time_calls(cpu, run, restored, iterations) / iterations * 1e9 -
+            overhead;
+  }
+  qsort(ns, repetitions, sizeof(double), compare_double);
+}
+
+int
+main(int argc, char** argv)
+{
+  long iterations = argc >= 2 ? atol(argv[1]) : 1000000;
+  int repetitions = argc >= 3 ? atoi(argv[2]) : 15;
+  if (iterations <= 0 || repetitions <= 0 || repetitions > MAX_REPETITIONS) {
+    fprintf(stderr, "APEX_Help : Usage %s [iterations] [repetitions]\n",
+            argv[0]);
+    exit(1);
+  }
+
+  APEX_Config config = { .trace = 0, .out = stdout, .cycle_budget = LLONG_MAX };
+  APEX_CPU* cpu = APEX_cpu_create(&config);
+  if (!cpu) {
+    fprintf(stderr, "APEX_Error : Unable to allocate CPU\n");
+    exit(1);
+  }
+  cpu->code_memory = code;
+
+  /* Median cost of an empty call, without and with the restore */
+  double ns[MAX_REPETITIONS];
+  double overhead[2];
+  for (int restore = 0; restore < 2; ++restore) {
+    measure(cpu, empty_stage, NULL, restore, iterations, repetitions, 0, ns);
+    overhead[restore] = ns[repetitions / 2];
+  }
+  printf("call overhead %.2f ns, with restore %.2f ns, subtracted below\n",
+         overhead[0], overhead[1]);
+
+  printf("%-11s %-14s %8s %8s %8s %8s  (ns/call)\n", "stage", "scenario",
+         "min", "median", "mean", "stddev");
+  for (int s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s) {
+    int restore = scenarios[s].restore;
+    measure(cpu, scenarios[s].run, scenarios[s].setup, restore, iterations,
+            repetitions, overhead[restore], ns);
+    double mean = 0;
+    for (int r = 0; r < repetitions; ++r) {
+      mean += ns[r];
+    }
+    mean /= repetitions;
+    double variance = 0;
+    for (int r = 0; r < repetitions; ++r) {
+      variance += (ns[r] - mean) * (ns[r] - mean);
+    }
+    double stddev = repetitions > 1 ? sqrt(variance / (repetitions - 1)) : 0;
+    printf("%-11s %-14s %8.2f %8.2f %8.2f %8.2f\n", scenarios[s].stage,
+           scenarios[s].name, ns[0], ns[repetitions / 2], mean, stddev);
+  }
+
+  cpu->code_memory = NULL;
+  APEX_cpu_stop(cpu);
+  return 0;
+}
@@ -0,0 +1,375 @@
+/*
+ *  block_cache.c
+ *  Contains the basic-block functional engine. Straight-line runs of
+ *  code memory ending in BZ/BNZ/JUMP/HALT are decoded once into blocks,
+ *  with common instruction pairs fused into superinstructions, and the
+ *  blocks are chained to their successors so that loops run without
+ *  looking anything up again.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Superinstruction kinds, numbered after the plain opcode IDs */
+enum
+{
+  SI_MOVC_ADD = NUM_OPCODES,	// MOVC rd,#imm ; ADD rd2,rs1,rs2
+  SI_ADDL_BZ,			// ADDL rd,rs1,#imm ; BZ #imm2
+  SI_ADDL_BNZ,			// ADDL rd,rs1,#imm ; BNZ #imm2
+  SI_SUBL_BZ,			// SUBL rd,rs1,#imm ; BZ #imm2
+  SI_SUBL_BNZ,			// SUBL rd,rs1,#imm ; BNZ #imm2
+};
+
+/* How control leaves a block */
+enum
+{
+  EXIT_FALL,	// ran off the end of a straight-line run
+  EXIT_BRANCH,	// BZ/BNZ, possibly fused
+  EXIT_JUMP,
+  EXIT_HALT,
+};
+
+/* One host-side operation of a block */
+typedef struct Block_Op
+{
+  unsigned char kind;	// Opcode ID or superinstruction kind
+  unsigned char rd;
+  unsigned char rs1;
+  unsigned char rs2;
+  unsigned char rs3;
+  unsigned char rd2;	// Destination of the second half of MOVC+ADD
+  int imm;
+} Block_Op;
+
+typedef struct Block
+{
+  int length;		    // Instructions covered by the block
+  int exit;		        // EXIT_* kind
+  int fall_index;	    // Code index reached by falling through
+  int taken_index;	    // Code index reached by a taken branch
+  struct Block* fall;	// Chained successors, resolved on first use
+  struct Block* taken;
+  int num_ops;
+  Block_Op ops[];
+} Block;
+
+typedef struct Block_Cache
+{
+  Block** blocks;	// One slot per code index
+  int size;
+} Block_Cache;
+
+static int
+is_block_end(int op)
+{
+  return op == OP_BZ || op == OP_BNZ || op == OP_JUMP || op == OP_HALT;
+}
+
+/*
+ * Decodes the block starting at code index start
+ */
+static Block*
+create_block(const APEX_Instruction* code, int size, int start)
+{
+  int end = start;
+  while (end < size && !is_block_end(code[end].op)) {
+    end++;
+  }
+  int length = (end < size ? end + 1 : end) - start;
+
+  Block* block = malloc(sizeof(*block) + sizeof(Block_Op) * length);
+  if (!block) {
+    return NULL;
+  }
+  block->length = length;
+  block->exit = EXIT_FALL;
+  block->fall_index = start + length;
+  block->taken_index = -1;
+  block->fall = NULL;
+  block->taken = NULL;
+
+  int n = 0;
+  for (int i = start; i < start + length; ++i) {
+    const APEX_Instruction* ins = &code[i];
+    const APEX_Instruction* next = i + 1 < start + length ? &code[i + 1] : NULL;
+    Block_Op* op = &block->ops[n++];
+    op->kind = ins->op;
+    op->rd = ins->rd;
+    op->rs1 = ins->rs1;
+    op->rs2 = ins->rs2;
+    op->rs3 = ins->rs3;
+    op->rd2 = 0;
+    op->imm = ins->imm;
+
+    if (!next) {
+      continue;
+    }
+    if (ins->op == OP_MOVC && next->op == OP_ADD) {
+      op->kind = SI_MOVC_ADD;
+      op->rd2 = next->rd;
+      op->rs1 = next->rs1;
+      op->rs2 = next->rs2;
+      i++;
+    }
+    else if ((ins->op == OP_ADDL || ins->op == OP_SUBL) &&
+             (next->op == OP_BZ || next->op == OP_BNZ)) {
+      if (ins->op == OP_ADDL) {
+        op->kind = next->op == OP_BZ ? SI_ADDL_BZ : SI_ADDL_BNZ;
+      }
+      else {
+        op->kind = next->op == OP_BZ ? SI_SUBL_BZ : SI_SUBL_BNZ;
+      }
+      i++;
+    }
+  }
+  block->num_ops = n;
+
+  const APEX_Instruction* last = &code[start + length - 1];
+  if (end < size) {
+    switch (last->op) {
+      case OP_BZ:
+      case OP_BNZ:
+        block->exit = EXIT_BRANCH;
+        block->taken_index = get_code_index(4000 + 4 * end + last->imm);
+        break;
+
+      case OP_JUMP:
+        block->exit = EXIT_JUMP;
+        break;
+
+      case OP_HALT:
+        block->exit = EXIT_HALT;
+        break;
+    }
+  }
+  return block;
+}
+
+/*
+ * Returns the block starting at code index, translating it on first use,
+ * or NULL if index lies outside code memory or the block could not be
+ * allocated
+ */
+static Block*
+get_block(Block_Cache* cache, const APEX_Instruction* code, int index)
+{
+  if (index < 0 || index >= cache->size) {
+    return NULL;
+  }
+  if (!cache->blocks[index]) {
+    cache->blocks[index] = create_block(code, cache->size, index);
+  }
+  return cache->blocks[index];
+}
+
+void
+APEX_block_cache_free(Block_Cache* cache)
+{
+  if (!cache) {
+    return;
+  }
+  for (int i = 0; i < cache->size; ++i) {
+    free(cache->blocks[i]);
+  }
+  free(cache->blocks);
+  free(cache);
+}
+
+/*
+ * Same contract as APEX_functional_run, executing whole cached blocks at
+ * a time. A budget that ends inside a block, and everything from a block
+ * that could not be allocated on, is finished by the plain interpreter.
+ */
+long long
+APEX_block_run(APEX_CPU* cpu, long long count)
+{
+  APEX_cpu_leave_pipeline(cpu);
+  if (!cpu->block_cache) {
+    Block_Cache* cache = malloc(sizeof(*cache));
+    if (!cache) {
+      return APEX_functional_run(cpu, count);
+    }
+    cache->size = program_length(cpu);
+    cache->blocks = calloc(cache->size, sizeof(Block*));
+    if (!cache->blocks) {
+      free(cache);
+      return APEX_functional_run(cpu, count);
+    }
+    cpu->block_cache = cache;
+  }
+
+  Block_Cache* cache = cpu->block_cache;
+  const APEX_Instruction* code = cpu->code_memory;
+  int* regs = cpu->regs;
+  int* const* pages = cpu->data_pages;
+  unsigned int mem_size = cpu->data_memory_size;
+  int pc = cpu->pc;
+  int z = cpu->z;
+  long long executed = 0;
+
+  Block* block = get_block(cache, code, get_code_index(pc));
+  while (block) {
+    if (count - executed < block->length) {
+      break;
+    }
+
+    int taken = 0;
+    int target = 0;
+    const Block_Op* op = block->ops;
+    const Block_Op* end = op + block->num_ops;
+    for (; op < end; ++op) {
+      switch (op->kind) {
+        case OP_MOVC:
+          regs[op->rd] = op->imm;
+          break;
+
+        case OP_ADD:
+          regs[op->rd] = regs[op->rs1] + regs[op->rs2];
+          z = regs[op->rd] == 0;
+          break;
+
+        case OP_ADDL:
+          regs[op->rd] = regs[op->rs1] + op->imm;
+          z = regs[op->rd] == 0;
+          break;
+
+        case OP_SUB:
+          regs[op->rd] = regs[op->rs1] - regs[op->rs2];
+          z = regs[op->rd] == 0;
+          break;
+
+        case OP_SUBL:
+          regs[op->rd] = regs[op->rs1] - op->imm;
+          z = regs[op->rd] == 0;
+          break;
+
+        case OP_MUL:
+          regs[op->rd] = regs[op->rs1] * regs[op->rs2];
+          z = regs[op->rd] == 0;
+          break;
+
+        case OP_AND:
+          regs[op->rd] = regs[op->rs1] & regs[op->rs2];
+          break;
+
+        case OP_OR:
+          regs[op->rd] = regs[op->rs1] | regs[op->rs2];
+          break;
+
+        case OP_EXOR:
+          regs[op->rd] = regs[op->rs1] ^ regs[op->rs2];
+          break;
+
+        case OP_LOAD:
+          regs[op->rd] = load_data_word(cpu, pages, mem_size,
+                                        regs[op->rs1] + op->imm);
+          break;
+
+        case OP_LDR:
+          regs[op->rd] = load_data_word(cpu, pages, mem_size,
+                                        regs[op->rs1] + regs[op->rs2]);
+          break;
+
+        case OP_STORE:
+          store_data_word(cpu, pages, mem_size,
+                          regs[op->rs2] + op->imm, regs[op->rs1]);
+          break;
+
+        case OP_STR:
+          store_data_word(cpu, pages, mem_size,
+                          regs[op->rs2] + regs[op->rs3], regs[op->rs1]);
+          break;
+
+        case OP_BZ:
+          taken = z;
+          break;
+
+        case OP_BNZ:
+          taken = !z;
+          break;
+
+        case OP_JUMP:
+          target = regs[op->rs1] + op->imm;
+          break;
+
+        case SI_MOVC_ADD:
+          regs[op->rd] = op->imm;
+          regs[op->rd2] = regs[op->rs1] + regs[op->rs2];
+          z = regs[op->rd2] == 0;
+          break;
+
+        case SI_ADDL_BZ:
+        case SI_ADDL_BNZ:
+          regs[op->rd] = regs[op->rs1] + op->imm;
+          z = regs[op->rd] == 0;
+          taken = op->kind == SI_ADDL_BZ ? z : !z;
+          break;
+
+        case SI_SUBL_BZ:
+        case SI_SUBL_BNZ:
+          regs[op->rd] = regs[op->rs1] - op->imm;
+          z = regs[op->rd] == 0;
+          taken = op->kind == SI_SUBL_BZ ? z : !z;
+          break;
+      }
+    }
+    executed += block->length;
+
+    switch (block->exit) {
+      case EXIT_FALL:
+        pc = 4000 + 4 * block->fall_index;
+        if (!block->fall) {
+          block->fall = get_block(cache, code, block->fall_index);
+        }
+        block = block->fall;
+        break;
+
+      case EXIT_BRANCH:
+        if (taken) {
+          pc = 4000 + 4 * block->taken_index;
+          if (!block->taken) {
+            block->taken = get_block(cache, code, block->taken_index);
+          }
+          block = block->taken;
+        }
+        else {
+          pc = 4000 + 4 * block->fall_index;
+          if (!block->fall) {
+            block->fall = get_block(cache, code, block->fall_index);
+          }
+          block = block->fall;
+        }
+        break;
+
+      case EXIT_JUMP:
+        pc = target;
+        block = get_block(cache, code, get_code_index(pc));
+        break;
+
+      case EXIT_HALT:
+        pc = 4000 + 4 * block->fall_index;
+        cpu->end = 1;
+        block = NULL;
+        break;
+    }
+  }
+
+  cpu->pc = pc;
+  cpu->z = z;
+  cpu->z_valid = 1;
+  cpu->ins_completed += executed;
+  if (cpu->end != 1) {
+    int index = get_code_index(pc);
+    if (index < 0 || index >= cache->size) {
+      /* Left code memory */
+      cpu->end = 1;
+    }
+    else {
+      /* The budget ends inside the next block, or translating it failed */
+      executed += APEX_functional_run(cpu, count - executed);
+    }
+  }
+  return executed;
+}
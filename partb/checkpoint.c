@@ -0,0 +1,265 @@
+/*
+ *  checkpoint.c
+ *  Contains checkpoint and restore of the full simulator state: clock,
+ *  PC, register file and scoreboard, all pipeline latches, the Z flag,
+ *  statistics and performance counters, and data memory. The forwarding
+ *  table is not saved since decode rebuilds it every cycle.
+ *
+ *  A checkpoint records a checksum of the code memory it was taken with
+ *  and is only restored into a CPU running the same program.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define APEX_CHECKPOINT_MAGIC "APXC"
+#define APEX_CHECKPOINT_VERSION 5
+
+/* Header at the start of every checkpoint file */
+typedef struct APEX_Checkpoint_Header
+{
+  char magic[4];	            // "APXC"
+  unsigned int version;	        // APEX_CHECKPOINT_VERSION
+  unsigned int stage_size;	    // sizeof(CPU_Stage) of the writer
+  unsigned int data_words;	    // Size of data memory in words
+  unsigned int code_size;	    // Instructions in the program
+  unsigned int code_checksum;	// FNV-1a over the program's code memory
+  unsigned int checksum;	    // FNV-1a over everything that follows
+  unsigned int num_pages;	    // Data memory pages stored after the state
+} APEX_Checkpoint_Header;
+
+/* Architectural and pipeline state, stored right after the header */
+typedef struct APEX_Checkpoint_State
+{
+  long long clock;
+  int pc;
+  int regs[32];
+  unsigned int regs_pending;
+  unsigned int regs_written;
+  CPU_Stage stage[NUM_STAGES];
+  int code_memory_size;
+  int z;
+  int z_valid;
+  int end;
+  long long ins_completed;
+  long long stall_cycles;
+  long long mem_faults;
+  int mem_fault_address;
+  int stall_cause;
+  APEX_Counters counters;
+} APEX_Checkpoint_State;
+
+/* Data memory page, stored only if it holds a non-zero word */
+typedef struct APEX_Checkpoint_Page
+{
+  unsigned int index;
+  int words[DATA_PAGE_WORDS];
+} APEX_Checkpoint_Page;
+
+static unsigned int
+code_checksum(const APEX_CPU* cpu)
+{
+  const APEX_Program* program = cpu->program;
+  return apex_checksum(program->code_memory,
+                       sizeof(APEX_Instruction) * program->code_memory_size);
+}
+
+static void
+fill_header(const APEX_CPU* cpu, APEX_Checkpoint_Header* header)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, APEX_CHECKPOINT_MAGIC, sizeof(header->magic));
+  header->version = APEX_CHECKPOINT_VERSION;
+  header->stage_size = sizeof(CPU_Stage);
+  header->data_words = cpu->data_memory_size;
+  header->code_size = cpu->program->code_memory_size;
+  header->code_checksum = code_checksum(cpu);
+}
+
+/*
+ * Returns 1 if state is safe to resume. The checksum only catches
+ * corruption, while latch opcodes and the stall cause index tables when
+ * the run resumes. Fetch bounds its own reads by the program.
+ */
+static int
+valid_state(const APEX_Checkpoint_State* state)
+{
+  if (state->clock < 1 || state->pc < 4000 || state->stall_cause < 0 ||
+      state->stall_cause >= NUM_STALL_CAUSES) {
+    return 0;
+  }
+  for (int i = 0; i < NUM_STAGES; ++i) {
+    if (state->stage[i].op >= NUM_OPCODES) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int
+is_zero_page(const int* page)
+{
+  for (int i = 0; i < DATA_PAGE_WORDS; ++i) {
+    if (page[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Writes the state of cpu to filename. Only dirty data memory pages are
+ * visited, and those that hold only zeros are left out.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename)
+{
+  if (!cpu->program) {
+    return -1;
+  }
+
+  APEX_Checkpoint_State state;
+  memset(&state, 0, sizeof(state));
+  state.clock = cpu->clock;
+  state.pc = cpu->pc;
+  memcpy(state.regs, cpu->regs, sizeof(state.regs));
+  state.regs_pending = cpu->regs_pending;
+  state.regs_written = cpu->regs_written;
+  memcpy(state.stage, cpu->stage, sizeof(state.stage));
+  state.code_memory_size = cpu->code_memory_size;
+  state.z = cpu->z;
+  state.z_valid = cpu->z_valid;
+  state.end = cpu->end;
+  state.ins_completed = cpu->ins_completed;
+  state.stall_cycles = cpu->stall_cycles;
+  state.mem_faults = cpu->mem_faults;
+  state.mem_fault_address = cpu->mem_fault_address;
+  state.stall_cause = cpu->stall_cause;
+  state.counters = cpu->counters;
+
+  APEX_Checkpoint_Header header;
+  fill_header(cpu, &header);
+  header.checksum = apex_checksum(&state, sizeof(state));
+  unsigned int num_pages = cpu->num_data_pages;
+  for (unsigned int i = next_dirty_page(cpu, 0); i < num_pages;
+       i = next_dirty_page(cpu, i + 1)) {
+    const int* page = cpu->data_pages[i];
+    if (page && !is_zero_page(page)) {
+      header.num_pages++;
+      header.checksum = apex_checksum_update(header.checksum, &i, sizeof(i));
+      header.checksum = apex_checksum_update(header.checksum, page,
+                                             sizeof(int) * DATA_PAGE_WORDS);
+    }
+  }
+
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(&state, sizeof(state), 1, fp) == 1;
+  for (unsigned int i = next_dirty_page(cpu, 0); ok && i < num_pages;
+       i = next_dirty_page(cpu, i + 1)) {
+    const int* page = cpu->data_pages[i];
+    if (page && !is_zero_page(page)) {
+      ok = fwrite(&i, sizeof(i), 1, fp) == 1 &&
+           fwrite(page, sizeof(int) * DATA_PAGE_WORDS, 1, fp) == 1;
+    }
+  }
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Replaces the state of cpu with a checkpoint taken of the same program
+ * with the same data memory size.
+ *
+ * Returns 0 on success, -1 if the file is not a valid checkpoint of the
+ * attached program, in which case cpu is left untouched
+ */
+int
+APEX_cpu_restore(APEX_CPU* cpu, const char* filename)
+{
+  if (!cpu->program) {
+    return -1;
+  }
+
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return -1;
+  }
+  APEX_Checkpoint_Header header;
+  APEX_Checkpoint_Header expected;
+  APEX_Checkpoint_State state;
+  APEX_Checkpoint_Page* pages = NULL;
+  fill_header(cpu, &expected);
+  int ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+           header.num_pages <= (unsigned int)cpu->num_data_pages &&
+           fread(&state, sizeof(state), 1, fp) == 1;
+  if (ok && header.num_pages > 0) {
+    pages = malloc(sizeof(*pages) * header.num_pages);
+    ok = pages && fread(pages, sizeof(*pages), header.num_pages, fp) ==
+                    header.num_pages;
+  }
+  ok = ok && fgetc(fp) == EOF;
+  fclose(fp);
+
+  if (ok) {
+    expected.num_pages = header.num_pages;
+    expected.checksum = apex_checksum(&state, sizeof(state));
+    for (unsigned int i = 0; i < header.num_pages; ++i) {
+      expected.checksum = apex_checksum_update(expected.checksum, &pages[i],
+                                               sizeof(pages[i]));
+      /* Pages are stored in increasing index order */
+      if (pages[i].index >= (unsigned int)cpu->num_data_pages ||
+          (i > 0 && pages[i].index <= pages[i - 1].index)) {
+        ok = 0;
+      }
+    }
+    ok = ok && memcmp(&header, &expected, sizeof(header)) == 0 &&
+         valid_state(&state);
+  }
+  if (!ok) {
+    free(pages);
+    return -1;
+  }
+
+  APEX_intervals_sample(cpu);
+  cpu->clock = state.clock;
+  cpu->pc = state.pc;
+  memcpy(cpu->regs, state.regs, sizeof(cpu->regs));
+  cpu->regs_pending = state.regs_pending;
+  cpu->regs_written = state.regs_written;
+  memcpy(cpu->stage, state.stage, sizeof(cpu->stage));
+  cpu->code_memory_size = state.code_memory_size;
+  cpu->z = state.z;
+  cpu->z_valid = state.z_valid;
+  cpu->end = state.end;
+  cpu->ins_completed = state.ins_completed;
+  cpu->stall_cycles = state.stall_cycles;
+  cpu->stall_cause = state.stall_cause;
+  cpu->counters = state.counters;
+
+  clear_data_memory(cpu);
+  for (unsigned int i = 0; i < header.num_pages; ++i) {
+    int* page = cpu->data_pages[pages[i].index];
+    if (!page) {
+      page = alloc_data_page(cpu, pages[i].index * DATA_PAGE_WORDS);
+    }
+    if (page) {
+      memcpy(page, pages[i].words, sizeof(pages[i].words));
+      mark_data_dirty(cpu, pages[i].index * DATA_PAGE_WORDS);
+    }
+  }
+  cpu->mem_faults = state.mem_faults;
+  cpu->mem_fault_address = state.mem_fault_address;
+  APEX_intervals_restart(cpu);
+  free(pages);
+  return 0;
+}
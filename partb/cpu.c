@@ -7,111 +7,300 @@
  *  State University of New York, Binghamton
  */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
 
 #include "cpu.h"
 
-/* Set this flag to 1 to enable debug messages */
-int ENABLE_DEBUG_MESSAGES = 1;
+_Static_assert(sizeof(CPU_Stage) <= 32, "pipeline latch must stay packed");
 
+/*
+ * Records, for every register, the latch holding a value decode can
+ * forward this cycle, and the nearest latch producing the Z flag. Runs
+ * once per cycle after the stages below decode have moved their latches;
+ * earlier latches are visited last so that the youngest value wins.
+ */
+static void
+build_forwarding_table(APEX_CPU* cpu)
+{
+  memset(cpu->fwd, 0, sizeof(cpu->fwd));
+  cpu->fwd_z = 0;
 
-int comparator(APEX_CPU* cpu, int r_name, int *rs_value){
-  for(int i=MEM1; i<=WB; i++){
-    CPU_Stage* stage = &cpu->stage[i];
-    if(stage->rd == r_name){
-      if( strcmp(stage->opcode,"MOVC") == 0
-        || strcmp(stage->opcode,"ADDL")== 0 || strcmp(stage->opcode,"ADD")== 0 
-        ||strcmp(stage->opcode,"SUBL")== 0 || strcmp(stage->opcode,"SUB")== 0
-        || strcmp(stage->opcode,"AND")== 0 || strcmp(stage->opcode,"OR")== 0
-        || strcmp(stage->opcode,"EX-OR")== 0|| strcmp(stage->opcode,"MUL")== 0){
-        
-        *rs_value = stage->buffer; //forwarding
-        return 1;
-      }
+  CPU_Stage* stage = &cpu->stage[WB];
+  if(stage->op_class & (OPC_ALU_FWD | OPC_LOAD_FWD)){
+    cpu->fwd[stage->rd] = WB;
+  }
+  for(int i=MEM2; i>=MEM1; i--){
+    stage = &cpu->stage[i];
+    if(stage->op_class & OPC_ALU_FWD){
+      cpu->fwd[stage->rd] = i;
     }
   }
-  CPU_Stage* stage = &cpu->stage[WB];
-  if(stage->rd == r_name){
-    if(strcmp(stage->opcode,"LOAD") == 0 || strcmp(stage->opcode,"LDR") == 0){
-      *rs_value = stage->buffer; //forwarding
-      return 1;
+  for(int i=MEM2; i>=EX2; i--){
+    if(cpu->stage[i].op_class & OPC_Z_FWD){
+      cpu->fwd_z = i;
     }
-  }  
+  }
+}
+
+/* Returns 1 if the register file holds the current value of r_name */
+static inline int
+reg_ready(APEX_CPU* cpu, int r_name)
+{
+  return (cpu->regs_written & ~cpu->regs_pending) >> r_name & 1;
+}
+
+int comparator(APEX_CPU* cpu, int r_name, int *rs_value){
+  int i = cpu->fwd[r_name];
+  if(i){
+    *rs_value = cpu->stage[i].buffer; //forwarding
+    return 1;
+  }
   return 0;
 }
 
 int comparator_z(APEX_CPU* cpu, int* z){
-  CPU_Stage* stage = &cpu->stage[EX2];
-  if(strcmp(stage->opcode,"ADD") == 0 || strcmp(stage->opcode,"ADDl") == 0
-    || strcmp(stage->opcode,"SUB") == 0 || strcmp(stage->opcode,"SUBL") == 0
-    || strcmp(stage->opcode,"MUL") == 0 ){
+  if(cpu->fwd_z == 0 || cpu->fwd_z == EX2){ // none, or still being computed
     return 0;
-    }
-  for(int i=MEM1; i<WB; i++){
-    CPU_Stage* stage = &cpu->stage[i];
-    if(strcmp(stage->opcode,"ADD") == 0 || strcmp(stage->opcode,"ADDl") == 0
-      || strcmp(stage->opcode,"SUB") == 0 || strcmp(stage->opcode,"SUBL") == 0
-      || strcmp(stage->opcode,"MUL") == 0 ){
-      
-      if(stage->buffer == 0){
-        *z = 1;
-        
-      }
-      else{
-        *z = 0;
-        
+  }
+  if(cpu->stage[cpu->fwd_z].buffer == 0){
+    *z = 1;
+  }
+  else{
+    *z = 0;
+  }
+  return 1;
+}
+/*
+ * Counts the operands of stage, which is leaving decode, that came from
+ * the forwarding table rather than the register file
+ */
+static void
+count_forwards(APEX_CPU* cpu, const CPU_Stage* stage)
+{
+  APEX_Counters* counters = &cpu->counters;
+  switch (stage->op) {
+    case OP_STR:
+      counters->forwards[cpu->fwd[stage->rs3]]++;
+      /* fall through */
+    case OP_STORE:
+    case OP_LDR:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+    case OP_OR:
+    case OP_EXOR:
+    case OP_MUL:
+      counters->forwards[cpu->fwd[stage->rs2]]++;
+      /* fall through */
+    case OP_LOAD:
+    case OP_ADDL:
+    case OP_SUBL:
+      counters->forwards[cpu->fwd[stage->rs1]]++;
+      break;
+
+    case OP_BZ:
+    case OP_BNZ:
+      if (stage->z_valid) {
+        counters->z_forwards[cpu->fwd_z]++;
       }
-      return 1;
-    }
+      break;
   }
-  return 0;
+}
 
+/*
+ * Squashes the fetch, decode and execute1 latches behind a taken branch,
+ * counting each instruction lost as a flush bubble
+ */
+static void
+flush_wrong_path(APEX_CPU* cpu)
+{
+  int bubbles = 0;
+  for (int i = F; i <= EX1; ++i) {
+    if (cpu->stage[i].op != OP_NONE) {
+      bubbles++;
+    }
+  }
+  cpu->counters.stalls[STALL_FLUSH] += bubbles;
+  if (cpu->profile) {
+    APEX_profile_branch(cpu, &cpu->stage[EX2], bubbles);
+  }
+  memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
 }
+
 /*
- * This function creates and initializes APEX cpu.
+ * This function creates and initializes APEX cpu, with an empty code
+ * memory. A NULL config selects the defaults: trace on, output to stdout,
+ * no cycle budget and DEFAULT_DATA_MEMORY_SIZE words of data memory.
  *
  * Note : You are free to edit this function according to your
  *                 implementation
  */
 APEX_CPU*
-APEX_cpu_init(const char* filename)
+APEX_cpu_create(const APEX_Config* config)
 {
-  if (!filename) {
+  APEX_CPU* cpu = malloc(sizeof(*cpu));
+  if (!cpu) {
     return NULL;
   }
 
-  APEX_CPU* cpu = malloc(sizeof(*cpu));
-  if (!cpu) {
+  if (config) {
+    cpu->config = *config;
+  }
+  else {
+    cpu->config.trace = 1;
+    cpu->config.out = NULL;
+    cpu->config.err = stderr;
+    cpu->config.cycle_budget = LLONG_MAX;
+    cpu->config.progress = 0;
+    cpu->config.sample_interval = 0;
+    cpu->config.sample_warmup = 0;
+    cpu->config.sample_length = 0;
+    cpu->config.data_memory_size = 0;
+    cpu->config.data_dump = NULL;
+    cpu->config.trace_first = 0;
+    cpu->config.trace_last = 0;
+    cpu->config.trace_pc_low = 0;
+    cpu->config.trace_pc_high = 0;
+    cpu->config.trace_file = NULL;
+    cpu->config.counters_file = NULL;
+    cpu->config.profile = 0;
+    cpu->config.interval = 0;
+    cpu->config.interval_file = NULL;
+  }
+  if (!cpu->config.out) {
+    cpu->config.out = stdout;
+  }
+  if (cpu->config.data_memory_size <= 0) {
+    cpu->config.data_memory_size = DEFAULT_DATA_MEMORY_SIZE;
+  }
+  if (create_data_memory(cpu, cpu->config.data_memory_size) != 0) {
+    free(cpu);
     return NULL;
   }
 
+  cpu->program = NULL;
+  cpu->code_memory = NULL;
+  cpu->code_memory_size = 0;
+  cpu->threaded_code = NULL;
+  cpu->block_cache = NULL;
+  cpu->trace_writer = NULL;
+  cpu->trace_record = NULL;
+  cpu->profile = NULL;
+  cpu->profile_size = 0;
+  cpu->intervals = NULL;
+  cpu->interval_next = LLONG_MAX;
+  APEX_cpu_reset(cpu);
+  return cpu;
+}
+
+/*
+ * Puts the CPU back in its power-on state: registers, pipeline latches,
+ * data memory and statistics are cleared and the PC returns to 4000.
+ * The attached program, and everything translated from it, is kept.
+ */
+void
+APEX_cpu_reset(APEX_CPU* cpu)
+{
+  /* The interval statistics end the current row and go on from cycle 0 */
+  APEX_intervals_sample(cpu);
+
   /* Initialize PC, Registers and all pipeline stages */
   cpu->end = 0;
   cpu->pc = 4000;
+  cpu->z = 0;
+  cpu->z_valid = 0;
+  cpu->ins_completed = 0;
+  cpu->stall_cycles = 0;
+  cpu->stall_cause = STALL_NONE;
+  memset(&cpu->counters, 0, sizeof(cpu->counters));
+  if (cpu->profile) {
+    memset(cpu->profile, 0, sizeof(*cpu->profile) * cpu->profile_size);
+  }
   memset(cpu->regs, 0, sizeof(int) * 32);
-  memset(cpu->regs_valid, 1, sizeof(int) * 32);
+  cpu->regs_pending = 0;
+  cpu->regs_written = 0;
   memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES );
-  memset(cpu->data_memory, 0, sizeof(int) * 4000);
+  clear_data_memory(cpu);
 
-  /* Parse input file and create code memory */
-  cpu->code_memory = create_code_memory(filename, &cpu->code_memory_size);
+  /* Branches shrink code_memory_size to detect the end of the program */
+  if (cpu->program) {
+    cpu->code_memory_size = cpu->program->code_memory_size;
+  }
 
-  if (!cpu->code_memory) {
-    free(cpu);
+  /* Make all stages busy except Fetch stage, initally to start the pipeline */
+  for (int i = 1; i < NUM_STAGES; ++i) {
+    cpu->stage[i].busy = 1;
+  }
+
+  cpu->clock = 1;
+  APEX_intervals_restart(cpu);
+}
+
+/*
+ * Hands a CPU stopped mid-pipeline, as restored from a simulate
+ * checkpoint, to the functional engines: the PC goes back to the oldest
+ * instruction still in flight, none of whose results have reached the
+ * register file, and the latches are emptied as on reset. A STORE that
+ * already wrote memory in MEM2 runs again and rewrites the same word.
+ */
+void
+APEX_cpu_leave_pipeline(APEX_CPU* cpu)
+{
+  int in_flight = 0;
+  for (int i = WB; i >= F; --i) {
+    if (cpu->stage[i].op != OP_NONE) {
+      cpu->pc = cpu->stage[i].pc;
+      in_flight = 1;
+      break;
+    }
+  }
+  if (!in_flight) {
+    return;
+  }
+  memset(cpu->stage, 0, sizeof(CPU_Stage) * NUM_STAGES);
+  for (int i = 1; i < NUM_STAGES; ++i) {
+    cpu->stage[i].busy = 1;
+  }
+  cpu->regs_pending = 0;
+  cpu->stall_cause = STALL_NONE;
+  cpu->code_memory_size = program_length(cpu);
+}
+
+/*
+ * Creates a CPU with config (NULL for the defaults) and loads filename
+ * into it, printing code memory if trace is on
+ */
+APEX_CPU*
+APEX_cpu_open(const char* filename, const APEX_Config* config)
+{
+  if (!filename) {
+    return NULL;
+  }
+
+  APEX_CPU* cpu = APEX_cpu_create(config);
+  if (!cpu) {
     return NULL;
   }
 
-  if (ENABLE_DEBUG_MESSAGES) {
-    fprintf(stderr,
-            "APEX_CPU : Initialized APEX CPU, loaded %d instructions\n",
-            cpu->code_memory_size);
-    fprintf(stderr, "APEX_CPU : Printing Code Memory\n");
-    printf("%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2","rs3", "imm");
+  /* Parse input file and create code memory */
+  if (APEX_cpu_load(cpu, filename) != 0) {
+    APEX_cpu_stop(cpu);
+    return NULL;
+  }
+
+  if (cpu->config.trace) {
+    APEX_cpu_message(cpu, "APEX_CPU : Initialized APEX CPU, "
+                     "loaded %d instructions\n", cpu->code_memory_size);
+    APEX_cpu_message(cpu, "APEX_CPU : Printing Code Memory\n");
+    fprintf(cpu->config.out, "%-9s %-9s %-9s %-9s %-9s %-9s\n", "opcode", "rd", "rs1", "rs2","rs3", "imm");
 
     for (int i = 0; i < cpu->code_memory_size; ++i) {
-      printf("%-9s %-9d %-9d %-9d %-9d %-9d\n",
-             cpu->code_memory[i].opcode,
+      fprintf(cpu->config.out, "%-9s %-9d %-9d %-9d %-9d %-9d\n",
+             get_opcode_name(cpu->code_memory[i].op),
              cpu->code_memory[i].rd,
              cpu->code_memory[i].rs1,
              cpu->code_memory[i].rs2,
@@ -119,14 +308,65 @@ APEX_cpu_init(const char* filename)
              cpu->code_memory[i].imm);
     }
   }
+  return cpu;
+}
 
-  /* Make all stages busy except Fetch stage, initally to start the pipeline */
-  for (int i = 1; i < NUM_STAGES; ++i) {
-    cpu->stage[i].busy = 1;
+/*
+ * Creates a CPU with the default config and loads filename into it
+ */
+APEX_CPU*
+APEX_cpu_init(const char* filename)
+{
+  return APEX_cpu_open(filename, NULL);
+}
+
+/* Drops everything translated from the current code memory */
+static void
+flush_code_caches(APEX_CPU* cpu)
+{
+  free(cpu->threaded_code);
+  cpu->threaded_code = NULL;
+  APEX_block_cache_free(cpu->block_cache);
+  cpu->block_cache = NULL;
+}
+
+/*
+ * Attaches a shared program as code memory, taking a reference to it and
+ * dropping the one held on the previous program. Caches built from the
+ * previous code memory are dropped.
+ */
+void
+APEX_cpu_attach(APEX_CPU* cpu, APEX_Program* program)
+{
+  if (program == cpu->program) {
+    return;
   }
+  flush_code_caches(cpu);
+  APEX_profile_free(cpu);
+  APEX_program_release(cpu->program);
+  cpu->program = APEX_program_retain(program);
+  cpu->code_memory = program->code_memory;
+  cpu->code_memory_size = program->code_memory_size;
+}
 
-  cpu->clock = 1;
-  return cpu;
+/*
+ * This function (re)loads code memory from an input file, either a text
+ * .asm file or a binary image written by apex-asm, into a program owned
+ * by this CPU alone.
+ *
+ * Returns 0 on success, -1 if the file could not be loaded, in which
+ * case the previous code memory is kept
+ */
+int
+APEX_cpu_load(APEX_CPU* cpu, const char* filename)
+{
+  APEX_Program* program = APEX_program_load(filename, cpu->config.err);
+  if (!program) {
+    return -1;
+  }
+  APEX_cpu_attach(cpu, program);
+  APEX_program_release(program);
+  return 0;
 }
 
 /*
@@ -138,7 +378,12 @@ APEX_cpu_init(const char* filename)
 void
 APEX_cpu_stop(APEX_CPU* cpu)
 {
-  free(cpu->code_memory);
+  APEX_trace_close(cpu);
+  APEX_intervals_close(cpu);
+  APEX_profile_free(cpu);
+  flush_code_caches(cpu);
+  APEX_program_release(cpu->program);
+  free_data_memory(cpu);
   free(cpu);
 }
 
@@ -154,55 +399,6 @@ get_code_index(int pc)
   return (pc - 4000) / 4;
 }
 
-static void
-print_instruction(CPU_Stage* stage)
-{
-  if (strcmp(stage->opcode, "HALT") == 0) {
-    printf("%s ", stage->opcode);
-  }
-  if (strcmp(stage->opcode, "STORE") == 0 ) {
-    printf(
-      "%s,R%d,R%d,#%d ", stage->opcode, stage->rs1, stage->rs2, stage->imm);
-  }
-
-  if (strcmp(stage->opcode, "MOVC") == 0) {
-    printf("%s,R%d,#%d ", stage->opcode, stage->rd, stage->imm);
-  }
-
-  if (strcmp(stage->opcode, "LOAD") == 0 || strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0 ) {
-    printf(
-      "%s,R%d,R%d,#%d ", stage->opcode, stage->rd, stage->rs1, stage->imm);
-  }
-  
-  if (strcmp(stage->opcode, "STR") == 0 || strcmp(stage->opcode, "LDR") == 0|| strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR" ) == 0 || strcmp(stage->opcode, "MUL") == 0) {
-    printf(
-      "%s,R%d,R%d,R%d ", stage->opcode, stage->rd, stage->rs1, stage->rs2 );
-  }
-
-  if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0 ) {
-    printf("%s,#%d ",stage->opcode, stage->imm);
-  }
-
-  if (strcmp(stage->opcode, "JUMP") == 0) {
-    printf("%s,R%d,#%d",stage->opcode,stage->rs1, stage->imm);
-  }
-
-}
-
-/* Debug function which dumps the cpu stage
- * content
- *
- * Note : You are not supposed to edit this function
- *
- */
-static void
-print_stage_content(char* name, CPU_Stage* stage)
-{
-  printf("%-15s: pc(%d) ", name, stage->pc);
-  print_instruction(stage);
-  printf("\n");
-}
-
 /*
  *  Fetch Stage of APEX Pipeline
  *
@@ -216,8 +412,8 @@ fetch(APEX_CPU* cpu)
   if(get_code_index(cpu->pc) > cpu->code_memory_size){ // pc excess code size or there was a HALT
     memset(&cpu->stage[F], 0, sizeof(CPU_Stage)); // stop fetch new code line
     cpu->stage[DRF] = cpu->stage[F];
-    if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Fetch", stage);
+    if (cpu->config.trace) {
+      APEX_trace_stage(cpu, F);
     }
     return 0;
   }
@@ -230,8 +426,15 @@ fetch(APEX_CPU* cpu)
      * fetch latch
      */
     
-    APEX_Instruction* current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
-    strcpy(stage->opcode, current_ins->opcode);
+    /* Taken backward BZ/BNZ grow code_memory_size past the program, so
+     * a PC outside the program reads as an empty instruction */
+    static const APEX_Instruction empty_ins;
+    const APEX_Instruction* current_ins = &empty_ins;
+    if (cpu->pc >= 4000 && get_code_index(cpu->pc) < program_length(cpu)) {
+      current_ins = &cpu->code_memory[get_code_index(cpu->pc)];
+    }
+    stage->op = current_ins->op;
+    stage->op_class = current_ins->op_class;
     stage->rd = current_ins->rd;
     stage->rs1 = current_ins->rs1;
     stage->rs2 = current_ins->rs2;
@@ -243,7 +446,6 @@ fetch(APEX_CPU* cpu)
 
     /* Update PC for next instruction */
     cpu->pc += 4;
-    printf("cpu -> pc%d",cpu->pc);
   }
   if(!stage->stalled){
     stage->busy = 0;
@@ -253,8 +455,8 @@ fetch(APEX_CPU* cpu)
     stage->busy = 1;
   }
 
-  if (ENABLE_DEBUG_MESSAGES) {
-    print_stage_content("Fetch", stage);
+  if (cpu->config.trace) {
+    APEX_trace_stage(cpu, F);
   }
   return 0;
 }
@@ -269,171 +471,150 @@ int
 decode(APEX_CPU* cpu)
 {
   CPU_Stage* stage = &cpu->stage[DRF];
+  int z;
+  cpu->stall_cause = STALL_NONE;
   if (!stage->busy && !stage->stalled) {
-
-    /* Read data from register file for store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-      
-      if((cpu->regs_valid[stage->rs1] == 1 || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
-      && (cpu->regs_valid[stage->rs2] == 1 || comparator(cpu,stage->rs2,&stage->rs2_value) == 1)){//all rs are valid
-        if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
-          stage->rs1_value = cpu->regs[stage->rs1];
+    build_forwarding_table(cpu);
+
+    switch (stage->op) {
+      /* Read data from register file for store */
+      case OP_STORE:
+      case OP_LDR:
+        if((reg_ready(cpu, stage->rs1) || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
+        && (reg_ready(cpu, stage->rs2) || comparator(cpu,stage->rs2,&stage->rs2_value) == 1)){//all rs are valid
+          if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
+            stage->rs1_value = cpu->regs[stage->rs1];
+          }
+          if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
+            stage->rs2_value = cpu->regs[stage->rs2];
+          }
+          cpu->stage[F].stalled = 0;
         }
-        if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
-          stage->rs2_value = cpu->regs[stage->rs2];
+        else{ // stall stage before decode.
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_RAW;
         }
-        cpu->stage[F].stalled = 0;
-      }
-      else{ // stall stage before decode.
-        cpu->stage[F].stalled = 1;
-      }
-    }
-
-    /* No Register file read needed for MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-    }
+        break;
 
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-      if(comparator(cpu,stage->rs1,&stage->rs1_value) == 1){
-        cpu->stage[F].stalled = 0;
-      }
-      else if(cpu->regs_valid[stage->rs1] == 1){
-        stage->rs1_value = cpu->regs[stage->rs1];
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-    }
+      /* No Register file read needed for MOVC */
+      case OP_MOVC:
+        break;
 
-    if (strcmp(stage->opcode, "STR") == 0) {
-      // if(comparator(cpu,stage->rs1,&stage->rs1_value) == 1 && comparator(cpu,stage->rs2,&stage->rs2_value)==1
-      //   && comparator(cpu,stage->rs3,&stage->rs3_value) == 1){
-      //   cpu->stage[F].stalled = 0;
-      // }
-      if((cpu->regs_valid[stage->rs1] == 1 || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
-        && (cpu->regs_valid[stage->rs2] == 1 || comparator(cpu,stage->rs2,&stage->rs2_value)==1) 
-        && (cpu->regs_valid[stage->rs3] == 1 || comparator(cpu,stage->rs3,&stage->rs3_value) == 1)){
-        if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
+      case OP_LOAD:
+      case OP_ADDL:
+      case OP_SUBL:
+        if(comparator(cpu,stage->rs1,&stage->rs1_value) == 1){
+          cpu->stage[F].stalled = 0;
+        }
+        else if(reg_ready(cpu, stage->rs1)){
           stage->rs1_value = cpu->regs[stage->rs1];
+          cpu->stage[F].stalled = 0;
         }
-        if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
-          stage->rs2_value = cpu->regs[stage->rs2];
+        else{
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_RAW;
         }
-        if(comparator(cpu,stage->rs3,&stage->rs3_value) == 0){
-          stage->rs3_value = cpu->regs[stage->rs3];
+        break;
+
+      case OP_STR:
+        if((reg_ready(cpu, stage->rs1) || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
+          && (reg_ready(cpu, stage->rs2) || comparator(cpu,stage->rs2,&stage->rs2_value)==1) 
+          && (reg_ready(cpu, stage->rs3) || comparator(cpu,stage->rs3,&stage->rs3_value) == 1)){
+          if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
+            stage->rs1_value = cpu->regs[stage->rs1];
+          }
+          if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
+            stage->rs2_value = cpu->regs[stage->rs2];
+          }
+          if(comparator(cpu,stage->rs3,&stage->rs3_value) == 0){
+            stage->rs3_value = cpu->regs[stage->rs3];
+          }
+          cpu->stage[F].stalled = 0;
         }
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-    }
-
-    if (strcmp(stage->opcode, "LDR") == 0){
-      if((cpu->regs_valid[stage->rs1] == 1 || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
-      && (cpu->regs_valid[stage->rs2] == 1 || comparator(cpu,stage->rs2,&stage->rs2_value) == 1)){//all rs are valid
-        if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
-          stage->rs1_value = cpu->regs[stage->rs1];
+        else{
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_RAW;
         }
-        if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
-          stage->rs2_value = cpu->regs[stage->rs2];
+        break;
+
+      case OP_ADD:
+      case OP_SUB:
+      case OP_AND:
+      case OP_OR:
+      case OP_EXOR:
+      case OP_MUL:
+        if((reg_ready(cpu, stage->rs1) || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
+        && (reg_ready(cpu, stage->rs2) || comparator(cpu,stage->rs2,&stage->rs2_value) == 1)){//all rs are valid
+          if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
+            stage->rs1_value = cpu->regs[stage->rs1];
+          }
+          if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
+            stage->rs2_value = cpu->regs[stage->rs2];
+          }
+          cpu->stage[F].stalled = 0;
         }
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-    }
-    if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0) {
-      if(comparator(cpu,stage->rs1,&stage->rs1_value) == 1 ){
-        cpu->stage[F].stalled = 0;
-      }
-      else if(cpu->regs_valid[stage->rs1] == 1){
-        stage->rs1_value = cpu->regs[stage->rs1];
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-    }
+        else{
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_RAW;
+        }
+        break;
+
+      case OP_BZ:
+      case OP_BNZ:
+        if(comparator_z(cpu,&z)==1){
+          stage->z = z;
+          cpu->stage[F].stalled = 0;
+          stage->z_valid = 1;
+        }
+        else if(cpu->z_valid == 1){
+          cpu->stage[F].stalled = 0;
+        }
+        else{
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_Z;
+        }
+        break;
 
-    if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 || strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "MUL") == 0) {
-      if((cpu->regs_valid[stage->rs1] == 1 || comparator(cpu,stage->rs1,&stage->rs1_value) == 1) 
-      && (cpu->regs_valid[stage->rs2] == 1 || comparator(cpu,stage->rs2,&stage->rs2_value) == 1)){//all rs are valid
-        if(comparator(cpu,stage->rs1,&stage->rs1_value) == 0){
+      case OP_JUMP:
+        if(reg_ready(cpu, stage->rs1)){
           stage->rs1_value = cpu->regs[stage->rs1];
+          cpu->stage[F].stalled = 0;
         }
-        if(comparator(cpu,stage->rs2,&stage->rs2_value) == 0){
-          stage->rs2_value = cpu->regs[stage->rs2];
+        else{
+          cpu->stage[F].stalled = 1;
+          cpu->stall_cause = STALL_RAW;
         }
-        cpu->stage[F].stalled = 0;
-      }
-      else if(cpu->regs_valid[stage->rs1] == 1 && cpu->regs_valid[stage->rs2] ==1){
-        stage->rs1_value = cpu->regs[stage->rs1];
-        stage->rs2_value = cpu->regs[stage->rs2];
-        cpu->stage[F].stalled = 0;
-        
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      
-      }
-    }
-
-    if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0) {
-      if(comparator_z(cpu,&stage->z)==1){
-        cpu->stage[F].stalled = 0;
-        stage->z_valid = 1;
-      }
-      else if(cpu->z_valid == 1){
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-      
-    }
-
-    if (strcmp(stage->opcode, "JUMP") == 0){
-      if(cpu->regs_valid[stage->rs1] == 1){
-        stage->rs1_value = cpu->regs[stage->rs1];
-        //printf("%d",stage->rs1_value);
-        cpu->stage[F].stalled = 0;
-      }
-      else{
-        cpu->stage[F].stalled = 1;
-      }
-    }
-
-    if (strcmp(stage->opcode, "HALT") == 0) {
-      int rest_code_size = 1;
-      for(int i=EX2; i<=WB; i++){
-        if(strcmp(cpu->stage[i].opcode, "") != 0){
-          rest_code_size++;
+        break;
+
+      case OP_HALT: {
+        int rest_code_size = 1;
+        for(int i=EX2; i<=WB; i++){
+          if(cpu->stage[i].op != OP_NONE){
+            rest_code_size++;
+          }
         }
+        cpu->ins_completed = cpu->code_memory_size - rest_code_size;
+        cpu->stage[EX1] = cpu->stage[DRF];
+        memset(cpu->stage,0,sizeof(CPU_Stage));
+        cpu->stage[F].stalled = 1;
+        cpu->stage[F].busy = 1;
+        break;
       }
-      cpu->ins_completed = cpu->code_memory_size - rest_code_size;
-      cpu->stage[EX1] = cpu->stage[DRF];
-      memset(cpu->stage,0,sizeof(CPU_Stage));
-      cpu->stage[F].stalled = 1;
-      cpu->stage[F].busy = 1;
     }
 
     /* Copy data from decode latch to execute latch*/
     if(cpu->stage[F].stalled == 0){
       cpu->stage[EX1] = cpu->stage[DRF];
+      count_forwards(cpu, stage);
     }
-    else if(strcmp(stage->opcode, "HALT") != 0){
+    else if(stage->op != OP_HALT){
       memset(&cpu->stage[EX1],0,sizeof(CPU_Stage));
     }
-
-
-
+    cpu->counters.stalls[cpu->stall_cause]++;
 
   }
-  if (ENABLE_DEBUG_MESSAGES) {
-    print_stage_content("Decode/RF", stage);
+  if (cpu->config.trace) {
+    APEX_trace_stage(cpu, DRF);
   }
   return 0;
 }
@@ -450,62 +631,37 @@ execute1(APEX_CPU* cpu) //keep rd's and z's status to invalid
   CPU_Stage* stage = &cpu->stage[EX1];
   if (!stage->busy && !stage->stalled) {
 
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    /* Store */
-    else if (strcmp(stage->opcode, "STORE") == 0) {
-       
-    }
-
-    else if (strcmp(stage->opcode, "LOAD") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "STR") == 0) {
-      
-    }
-
-    else if (strcmp(stage->opcode, "LDR") == 0){
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
-
-    else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 ) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-  
-    }
-
-    else if(strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "MUL") == 0){
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0 || strcmp(stage->opcode, "JUMP") == 0) {
-      printf("%d",stage->rs1_value);
+    switch (stage->op) {
+      case OP_MOVC:
+      case OP_LOAD:
+      case OP_LDR:
+      case OP_AND:
+      case OP_OR:
+      case OP_EXOR:
+      case OP_MUL:
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_ADD:
+      case OP_SUB:
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_HALT:
+        cpu->stage[F].stalled = 1;
+        cpu->stage[F].busy = 1;
+        memset(&cpu->stage[DRF],0,sizeof(CPU_Stage));
+        break;
     }
 
-    else if (strcmp(stage->opcode, "HALT") == 0) {
-      cpu->stage[F].stalled = 1;
-      cpu->stage[F].busy = 1;
-      memset(&cpu->stage[DRF],0,sizeof(CPU_Stage));
-    }
     /* Copy data from decode latch to execute latch*/
-   
     cpu->stage[EX2] = cpu->stage[EX1];
-    
-    /* Copy data from Execute latch to Memory latch*/
-
-    
   }
-  if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute1", stage);
+  if (cpu->config.trace) {
+      APEX_trace_stage(cpu, EX1);
   }
   return 0;
 }
@@ -516,143 +672,137 @@ execute2(APEX_CPU* cpu)
   CPU_Stage* stage = &cpu->stage[EX2];
   if (!stage->busy && !stage->stalled) {
 
-
-    /* MOVC */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      stage->buffer = stage->imm;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-      stage->mem_address = stage->rs2_value + stage->imm;
-    }
-
-    if (strcmp(stage->opcode, "LOAD") == 0) {
-      stage->mem_address = stage->rs1_value + stage->imm;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "STR") == 0) {
-      stage->mem_address = stage->rs2_value + stage->rs3_value;
-    }
-
-    if (strcmp(stage->opcode, "LDR") == 0){
-      stage->mem_address = stage->rs1_value + stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if (strcmp(stage->opcode, "ADDL") == 0 ) {
-      stage->buffer = stage->rs1_value + stage->imm;
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
-
-    if(strcmp(stage->opcode, "SUBL") == 0){
-      stage->buffer = stage->rs1_value - stage->imm;
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
-
-    if (strcmp(stage->opcode, "ADD") == 0 ) {
-      stage->buffer = stage->rs1_value + stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
-
-    if(strcmp(stage->opcode, "SUB") == 0){
-
-      stage->buffer = stage->rs1_value - stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    
-    }
-
-    if(strcmp(stage->opcode, "AND") == 0){
-      stage->buffer = stage->rs1_value & stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if(strcmp(stage->opcode, "OR") == 0){
-      stage->buffer = stage->rs1_value | stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if(strcmp(stage->opcode, "EX-OR") == 0){
-      stage->buffer = stage->rs1_value ^ stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    if(strcmp(stage->opcode, "MUL") == 0){
-      stage->buffer = stage->rs1_value * stage->rs2_value;
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
-
-    if (strcmp(stage->opcode, "BZ") == 0 ) {
-      stage->buffer = stage->imm;
-      if(stage->z_valid == 1){
-        if(stage->z == 1){
-          memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
+    switch (stage->op) {
+      case OP_MOVC:
+        stage->buffer = stage->imm;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_STORE:
+        stage->mem_address = stage->rs2_value + stage->imm;
+        break;
+
+      case OP_LOAD:
+        stage->mem_address = stage->rs1_value + stage->imm;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_STR:
+        stage->mem_address = stage->rs2_value + stage->rs3_value;
+        break;
+
+      case OP_LDR:
+        stage->mem_address = stage->rs1_value + stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_ADDL:
+        stage->buffer = stage->rs1_value + stage->imm;
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_SUBL:
+        stage->buffer = stage->rs1_value - stage->imm;
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_ADD:
+        stage->buffer = stage->rs1_value + stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_SUB:
+        stage->buffer = stage->rs1_value - stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_AND:
+        stage->buffer = stage->rs1_value & stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_OR:
+        stage->buffer = stage->rs1_value | stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_EXOR:
+        stage->buffer = stage->rs1_value ^ stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_MUL:
+        stage->buffer = stage->rs1_value * stage->rs2_value;
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
+
+      case OP_BZ:
+        stage->buffer = stage->imm;
+        if(stage->z_valid == 1){
+          if(stage->z == 1){
+            flush_wrong_path(cpu);
+            cpu->pc = stage->pc + stage->buffer;
+            cpu->code_memory_size -= (stage->buffer/4);
+            
+            cpu->stage[F].busy = 1;
+          }
+        }
+        else if(cpu->z == 1){
+          flush_wrong_path(cpu);
+         
           cpu->pc = stage->pc + stage->buffer;
           cpu->code_memory_size -= (stage->buffer/4);
-          
+         
           cpu->stage[F].busy = 1;
         }
-      }
-      else if(cpu->z == 1){
-        memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
-       
-        cpu->pc = stage->pc + stage->buffer;
-        cpu->code_memory_size -= (stage->buffer/4);
-       
-        cpu->stage[F].busy = 1;
-      }
-    }
-
-    if(strcmp(stage->opcode, "BNZ") == 0){
-      stage->buffer = stage->imm;
-      if(stage->z_valid == 1){
-        if(stage->z == 0){
-          memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
-          cpu->pc = stage->pc + stage->buffer;
+        break;
+
+      case OP_BNZ:
+        stage->buffer = stage->imm;
+        if(stage->z_valid == 1){
+          if(stage->z == 0){
+            flush_wrong_path(cpu);
+            cpu->pc = stage->pc + stage->buffer;
+            cpu->code_memory_size -= (stage->buffer/4);
+            
+            cpu->stage[F].busy = 1;
+          }
+        }
+        else if(cpu->z != 1){
+          flush_wrong_path(cpu);
+          cpu->pc = cpu->pc + stage->buffer;
           cpu->code_memory_size -= (stage->buffer/4);
-          
           cpu->stage[F].busy = 1;
         }
-      }
-      else if(cpu->z != 1){
-        memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
-        cpu->pc = cpu->pc + stage->buffer;
-        cpu->code_memory_size -= (stage->buffer/4);
-        cpu->stage[F].busy = 1;
-      }
-    }
+        break;
 
-    if (strcmp(stage->opcode, "JUMP") == 0){
-      stage->buffer = stage->rs1_value + stage->imm;
+      case OP_JUMP:
+        stage->buffer = stage->rs1_value + stage->imm;
 
-      memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
-      //cpu->code_memory_size += (cpu->pc - stage->buffer)/4 -4;
-      cpu->pc = stage->buffer;
+        flush_wrong_path(cpu);
+        //cpu->code_memory_size += (cpu->pc - stage->buffer)/4 -4;
+        cpu->pc = stage->buffer;
 
-      //printf("%d,%d",stage->rs1, stage->imm);
-      cpu->stage[F].busy = 1;
-    }
+        cpu->stage[F].busy = 1;
+        break;
 
-    if (strcmp(stage->opcode, "HALT") == 0) {
-      memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
-      cpu->stage[F].stalled = 1;
-      cpu->stage[F].busy = 1;
+      case OP_HALT:
+        memset(cpu->stage, 0, sizeof(CPU_Stage) * 3); //memset f,d,ex1 stage
+        cpu->stage[F].stalled = 1;
+        cpu->stage[F].busy = 1;
+        break;
     }
 
     /* Copy data from Execute latch to Memory latch*/
     cpu->stage[MEM1] = cpu->stage[EX2];
-
-    
   }
-  if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Execute2", stage);
+  if (cpu->config.trace) {
+      APEX_trace_stage(cpu, EX2);
   }
   return 0;
 }
@@ -668,54 +818,32 @@ memory1(APEX_CPU* cpu) // almost do nothing,keep rd's and z's status to invalid
 {
   CPU_Stage* stage = &cpu->stage[MEM1];
   if (!stage->busy && !stage->stalled) {
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    /* Store */
-    else if (strcmp(stage->opcode, "STORE") == 0) {
-       
-    }
-
-    else if (strcmp(stage->opcode, "LOAD") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "STR") == 0) {
-      
-    }
-
-    else if (strcmp(stage->opcode, "LDR") == 0){
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
 
-    else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 ) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
+    switch (stage->op) {
+      case OP_MOVC:
+      case OP_LOAD:
+      case OP_LDR:
+      case OP_AND:
+      case OP_OR:
+      case OP_EXOR:
+      case OP_MUL:
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
+
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_ADD:
+      case OP_SUB:
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
     }
 
-    else if(strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 || strcmp(stage->opcode, "MUL") == 0){
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0 || strcmp(stage->opcode, "JUMP") == 0) {
-      
-    }
-
-    else if (strcmp(stage->opcode, "HALT") == 0) {
-    }
     /* Copy data from decode latch to execute latch*/
     cpu->stage[MEM2] = cpu->stage[MEM1];
-
-    
   }
-  if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory1", stage);
+  if (cpu->config.trace) {
+      APEX_trace_stage(cpu, MEM1);
   }
   return 0;
 }
@@ -726,43 +854,32 @@ memory2(APEX_CPU* cpu)
   CPU_Stage* stage = &cpu->stage[MEM2];
   if (!stage->busy && !stage->stalled) {
 
-    /* Store */
-    if (strcmp(stage->opcode, "STORE") == 0) {
-      cpu->data_memory[stage->mem_address] = stage->rs1_value;
-    }
+    switch (stage->op) {
+      case OP_STORE:
+      case OP_STR:
+        write_data_memory(cpu, stage->mem_address, stage->rs1_value);
+        break;
 
-    /* MOVC */
-    else if (strcmp(stage->opcode, "LOAD") == 0) {
-      stage->buffer = cpu->data_memory[stage->mem_address]; //for forwarding
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "STR") == 0) {
-      cpu->data_memory[stage->mem_address] = stage->rs1_value;
-    }
-
-    else if (strcmp(stage->opcode, "LDR") == 0) {
-      stage->buffer = cpu->data_memory[stage->mem_address]; //for forwarding
-      cpu->regs_valid[stage->rd] = 0;
-    }
-
-    else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
-    }
+      case OP_LOAD:
+      case OP_LDR:
+        stage->buffer = read_data_memory(cpu, stage->mem_address); //for forwarding
+        cpu->regs_pending |= 1u << stage->rd;
+        break;
 
-    else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 ) {
-      cpu->regs_valid[stage->rd] = 0;
-      cpu->z_valid = 0;
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_ADD:
+      case OP_SUB:
+        cpu->regs_pending |= 1u << stage->rd;
+        cpu->z_valid = 0;
+        break;
     }
 
     /* Copy data from decode latch to execute latch*/
     cpu->stage[WB] = cpu->stage[MEM2];
-
-    
   }
-  if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Memory2", stage);
+  if (cpu->config.trace) {
+      APEX_trace_stage(cpu, MEM2);
   }
   return 0;
 }
@@ -780,104 +897,177 @@ writeback(APEX_CPU* cpu)
   if (!stage->busy && !stage->stalled) {
 
     /* Update register file */
-    if (strcmp(stage->opcode, "MOVC") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
-
-    else if (strcmp(stage->opcode, "STORE") == 0) {
-       
+    switch (stage->op) {
+      case OP_MOVC:
+      case OP_LOAD:
+      case OP_LDR:
+      case OP_AND:
+      case OP_OR:
+      case OP_EXOR:
+        cpu->regs[stage->rd] = stage->buffer;
+        cpu->regs_pending &= ~(1u << stage->rd);
+        cpu->regs_written |= 1u << stage->rd;
+        break;
+
+      case OP_ADDL:
+      case OP_SUBL:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+        cpu->regs[stage->rd] = stage->buffer;
+        cpu->regs_pending &= ~(1u << stage->rd);
+        cpu->regs_written |= 1u << stage->rd;
+        cpu->z_valid = 1;
+        if (stage->buffer == 0){
+          cpu->z = 1;
+        }
+        else{
+          cpu->z = 0;
+        }
+        break;
     }
 
-    else if (strcmp(stage->opcode, "LOAD") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
+    //cpu->stage[FIN] = cpu->stage[WB];
+    if(stage->op != OP_NONE && stage->op < NUM_OPCODES){
+      cpu->ins_completed++;
+      cpu->counters.committed++;
+      cpu->counters.mix[stage->op]++;
+      if (cpu->profile) {
+        APEX_profile_commit(cpu, stage);
+      }
     }
-
-    else if (strcmp(stage->opcode, "STR") == 0) {
-      
+    if(stage->op == OP_HALT){
+      cpu->end = 1;
     }
-
-    else if (strcmp(stage->opcode, "LDR") == 0){
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
+    if(get_code_index(stage->pc) == cpu->code_memory_size -1 ){
+      cpu->end = 1;
     }
-
-    else if (strcmp(stage->opcode, "ADDL") == 0 || strcmp(stage->opcode, "SUBL") == 0) {
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-      cpu->z_valid = 1;
-      if (stage->buffer == 0){
-        cpu->z = 1;
+    /* The last instruction committed, fetch has left the program and
+     * nothing younger is in flight */
+    if(get_code_index(stage->pc) == program_length(cpu) - 1 &&
+       get_code_index(cpu->pc) >= program_length(cpu)){
+      int i = F;
+      while (i < WB && cpu->stage[i].op == OP_NONE) {
+        i++;
       }
-      else{
-        cpu->z = 0;
+      if (i == WB) {
+        cpu->end = 1;
       }
     }
 
-    else if (strcmp(stage->opcode, "ADD") == 0 || strcmp(stage->opcode, "SUB") == 0 ||strcmp(stage->opcode, "MUL") == 0 ) {
-      cpu->regs_valid[stage->rd] = 1;
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->z_valid = 1;
-      if (stage->buffer == 0){
-        cpu->z = 1;
-      }
-      else{
-        cpu->z = 0;
-      }
-    }
+  }
+  if (cpu->config.trace) {
+      APEX_trace_stage(cpu, WB);
+  }
+  return 0;
+}
 
-    else if(strcmp(stage->opcode, "AND") == 0 || strcmp(stage->opcode, "OR") == 0 || strcmp(stage->opcode, "EX-OR") == 0 ){
-      cpu->regs[stage->rd] = stage->buffer;
-      cpu->regs_valid[stage->rd] = 1;
-    }
+/* Everything a pipeline cycle reads besides memory */
+typedef struct Pipeline_State
+{
+  CPU_Stage stage[NUM_STAGES];
+  long long ins_completed;
+  int regs[32];
+  unsigned int regs_pending;
+  unsigned int regs_written;
+  int pc;
+  int z;
+  int z_valid;
+  int code_memory_size;
+  int end;
+} Pipeline_State;
 
-    else if (strcmp(stage->opcode, "BZ") == 0 || strcmp(stage->opcode, "BNZ") == 0 || strcmp(stage->opcode, "JUMP") == 0) {
-      
-    }
-    
-    
-    //cpu->stage[FIN] = cpu->stage[WB];
-    if(strcmp(stage->opcode, "") != 0){
-      cpu->ins_completed++;
+static void
+save_pipeline_state(APEX_CPU* cpu, Pipeline_State* state)
+{
+  /* Clear any padding too, since pipeline_frozen compares whole structs */
+  memset(state, 0, sizeof(*state));
+  memcpy(state->stage, cpu->stage, sizeof(state->stage));
+  state->ins_completed = cpu->ins_completed;
+  memcpy(state->regs, cpu->regs, sizeof(state->regs));
+  state->regs_pending = cpu->regs_pending;
+  state->regs_written = cpu->regs_written;
+  state->pc = cpu->pc;
+  state->z = cpu->z;
+  state->z_valid = cpu->z_valid;
+  state->code_memory_size = cpu->code_memory_size;
+  state->end = cpu->end;
+}
+
+/*
+ * Returns 1 if the cycle that just ran changed nothing, given the state
+ * saved before it. The pipeline is then frozen: every later cycle would
+ * do exactly the same (a STORE sitting in MEM2 rewrites the same word),
+ * so no latch can change again.
+ */
+static int
+pipeline_frozen(APEX_CPU* cpu, const Pipeline_State* before)
+{
+  Pipeline_State after;
+  save_pipeline_state(cpu, &after);
+  return memcmp(before, &after, sizeof(after)) == 0;
+}
+
+/*
+ * Charges n frozen cycles, skipped without being simulated, to the
+ * statistics and moves the clock past them. Interval rows due inside the
+ * skip are written at their own cycle.
+ */
+static void
+skip_frozen_cycles(APEX_CPU* cpu, long long n)
+{
+  while (n > 0) {
+    long long run = n;
+    if (cpu->interval_next - (cpu->clock - 1) < run) {
+      run = cpu->interval_next - (cpu->clock - 1);
     }
-    if(strcmp(stage->opcode, "HALT") == 0){
-      cpu->end = 1;
+    cpu->stall_cycles += run;
+    cpu->counters.stalls[cpu->stall_cause] += run;
+    if (cpu->profile) {
+      APEX_profile_cycles(cpu, run);
     }
-    printf("CPUpc : %d, code : %d",get_code_index(cpu->pc),cpu->code_memory_size);
-    if(get_code_index(stage->pc) == cpu->code_memory_size -1 ){
-      printf("opcode : %s, %d",stage->opcode, stage->rs1);
-      printf("pc : %d, code : %d",get_code_index(stage->pc),cpu->code_memory_size);
-      cpu->end = 1;
+    cpu->clock += run;
+    n -= run;
+    if (cpu->clock - 1 >= cpu->interval_next) {
+      APEX_intervals_sample(cpu);
     }
-
-  }
-  if (ENABLE_DEBUG_MESSAGES) {
-      print_stage_content("Writeback", stage);
   }
-  return 0;
 }
 
 /*
- *  APEX CPU simulation loop
+ * Simulates up to cycles clock cycles of the pipeline, stopping early once
+ * the program has finished or the clock reaches config.cycle_budget.
  *
- *  Note : You are free to edit this function according to your
- *                  implementation
+ * Returns the number of cycles simulated
  */
-int
-APEX_cpu_run(APEX_CPU* cpu, int mode, int cycle)
+long long
+APEX_cpu_step(APEX_CPU* cpu, long long cycles)
 {
-  if(mode == 0){ // stimulate
-    ENABLE_DEBUG_MESSAGES = 0;
+  Pipeline_State before;
+  long long start = cpu->clock;
+  int idle = 0;	    // Stalled cycles in a row that committed nothing
+
+  /* Last cycle this call may simulate */
+  long long cycle = cycles < LLONG_MAX - cpu->clock ? cpu->clock + cycles - 1
+                                                    : LLONG_MAX - 1;
+  if (cycle > cpu->config.cycle_budget) {
+    cycle = cpu->config.cycle_budget;
   }
-  else if(mode == 1){ //display
-    ENABLE_DEBUG_MESSAGES = 1;
+  if (cpu->config.profile && APEX_profile_start(cpu) != 0) {
+    APEX_cpu_message(cpu, "APEX_Error : Unable to allocate the profile\n");
+    cpu->config.profile = 0;
   }
+  if (cpu->config.interval > 0 && APEX_intervals_open(cpu) != 0) {
+    APEX_cpu_message(cpu,
+                     "APEX_Error : Unable to write interval statistics %s\n",
+                     cpu->config.interval_file);
+    cpu->config.interval = 0;
+  }
+
   while (1) {
 
     /* All the instructions committed, so exit */
     if (cpu->end == 1) {
-      printf("(apex) >> Simulation Complete");
       break;
     }
 
@@ -885,13 +1075,20 @@ APEX_cpu_run(APEX_CPU* cpu, int mode, int cycle)
       break;
     }
 
-    if (ENABLE_DEBUG_MESSAGES) {
-      printf("--------------------------------\n");
-      printf("Clock Cycle #: %d\n", cpu->clock);
-      printf("--------------------------------\n");
+    if (cpu->config.trace) {
+      APEX_trace_begin_cycle(cpu);
     }
 
-    
+    /* A pipeline can only freeze behind a stalled fetch, once everything
+     * past decode has drained, and skipping is only exact when no
+     * per-cycle trace is printed. Ordinary stalls commit within
+     * NUM_STAGES cycles and never pay for the snapshot. */
+    int may_freeze = !cpu->config.trace && cpu->stage[F].stalled &&
+                     idle >= NUM_STAGES;
+    if (may_freeze) {
+      save_pipeline_state(cpu, &before);
+    }
+    long long committed = cpu->counters.committed;
 
     writeback(cpu);
     memory2(cpu);
@@ -900,33 +1097,265 @@ APEX_cpu_run(APEX_CPU* cpu, int mode, int cycle)
     execute1(cpu);
     decode(cpu);
     fetch(cpu);
+    if (cpu->config.trace) {
+      APEX_trace_end_cycle(cpu);
+    }
+    if (cpu->profile) {
+      APEX_profile_cycles(cpu, 1);
+    }
     cpu->clock++;
+    if (cpu->stage[F].stalled) {
+      cpu->stall_cycles++;
+      idle = cpu->counters.committed == committed ? idle + 1 : 0;
+    }
+    else {
+      idle = 0;
+    }
+    if (cpu->clock - 1 >= cpu->interval_next) {
+      APEX_intervals_sample(cpu);
+    }
+
+    if (may_freeze && cpu->stage[F].stalled && pipeline_frozen(cpu, &before)) {
+      /* Nothing can change before the cycle limit is reached */
+      if (cycle >= cpu->clock) {
+        skip_frozen_cycles(cpu, cycle - cpu->clock + 1);
+      }
+      break;
+    }
+  }
+  return cpu->clock - start;
+}
+
+/*
+ * Returns 1 once the program has committed HALT or left code memory
+ */
+int
+APEX_cpu_finished(const APEX_CPU* cpu)
+{
+  return cpu->end == 1;
+}
+
+/*
+ * Prints a printf-style message to config.err, if it is set
+ */
+void
+APEX_cpu_message(const APEX_CPU* cpu, const char* format, ...)
+{
+  if (!cpu->config.err) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  vfprintf(cpu->config.err, format, args);
+  va_end(args);
+}
+
+/*
+ * Reads architectural register reg into *value.
+ *
+ * Returns 0 on success, -1 if reg is not R0-R31
+ */
+int
+APEX_cpu_read_reg(const APEX_CPU* cpu, int reg, int* value)
+{
+  if (reg < 0 || reg >= 32) {
+    return -1;
+  }
+  *value = cpu->regs[reg];
+  return 0;
+}
+
+/*
+ * Reads the data memory word at address into *value.
+ *
+ * Returns 0 on success, -1 if address lies outside data memory
+ */
+int
+APEX_cpu_read_memory(const APEX_CPU* cpu, int address, int* value)
+{
+  if (address < 0 || address >= cpu->data_memory_size) {
+    return -1;
+  }
+  const int* page = cpu->data_pages[address >> DATA_PAGE_SHIFT];
+  *value = page ? page[address & (DATA_PAGE_WORDS - 1)] : 0;
+  return 0;
+}
 
+static double
+host_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Cycles (or instructions) run between checks of the host clock */
+#define PROGRESS_CHUNK (1 << 20)
+
+/*
+ * Runs budget pipeline cycles (mode 0 and 1) or instructions (modes 2-4).
+ * With config.progress set the budget is run in chunks, and a progress
+ * line with the simulation rate goes to config.err every config.progress
+ * seconds.
+ */
+static void
+run_engine(APEX_CPU* cpu, int mode, long long budget)
+{
+  long long chunk = cpu->config.progress > 0 ? PROGRESS_CHUNK : budget;
+  double last_time = cpu->config.progress > 0 ? host_seconds() : 0;
+  long long last_done = 0;
+  long long done = 0;
+
+  while (done < budget && cpu->end != 1) {
+    long long n = budget - done < chunk ? budget - done : chunk;
+    long long ran;
+    switch (mode) {
+      case 2:
+        ran = APEX_functional_run(cpu, n);
+        break;
+
+      case 3:
+        ran = APEX_threaded_run(cpu, n);
+        break;
+
+      case 4:
+        ran = APEX_block_run(cpu, n);
+        break;
+
+      default:
+        ran = APEX_cpu_step(cpu, n);
+        break;
+    }
+    done += ran;
+    if (ran < n && cpu->end != 1) {
+      /* Stopped by config.cycle_budget */
+      break;
+    }
+
+    if (cpu->config.progress > 0) {
+      double now = host_seconds();
+      if (now - last_time >= cpu->config.progress) {
+        double rate = (done - last_done) / (now - last_time) / 1e6;
+        if (mode >= 2) {
+          APEX_cpu_message(cpu, "(apex) >> %lld instructions, %.1f MIPS\n",
+                           cpu->ins_completed, rate);
+        }
+        else {
+          APEX_cpu_message(cpu, "(apex) >> cycle %lld, %lld instructions, "
+                           "%.1f Mcycles/s\n",
+                           cpu->clock - 1, cpu->ins_completed, rate);
+        }
+        last_time = now;
+        last_done = done;
+      }
+    }
+  }
+}
+
+/*
+ *  APEX CPU simulation loop
+ *
+ *  Note : You are free to edit this function according to your
+ *                  implementation
+ */
+int
+APEX_cpu_run(APEX_CPU* cpu, int mode, long long cycle)
+{
+  if(mode == 0){ // stimulate
+    cpu->config.trace = 0;
+  }
+  else if(mode == 1){ //display
+    cpu->config.trace = 1;
+  }
+  else if(mode >= 2 && mode <= 4){ // functional, cycle is an instruction budget
+    run_engine(cpu, mode, cycle);
+    if (cpu->end == 1) {
+      fprintf(cpu->config.out, "(apex) >> Simulation Complete");
+    }
+    display_reg_file(cpu);
+    display_data_memory(cpu);
+    return 0;
+  }
+  else if(mode == 5){ // sampled, cycle is an instruction budget
+    APEX_Sample_Result result;
+    APEX_sample_run(cpu, cycle, &result);
+    if (cpu->end == 1) {
+      fprintf(cpu->config.out, "(apex) >> Simulation Complete");
+    }
+    fprintf(cpu->config.out, "\n(apex) >> Sampled %lld instructions, %d samples\n",
+            result.instructions, result.samples);
+    if (result.samples > 0) {
+      fprintf(cpu->config.out,
+              "(apex) >> CPI %.4f +- %.4f (95%% confidence), "
+              "estimated cycles %.0f\n",
+              result.cpi, result.cpi_error, result.cpi * result.instructions);
+    }
+    display_reg_file(cpu);
+    display_data_memory(cpu);
+    return 0;
+  }
+
+  /* Simulate up to and including cycle */
+  if (cycle >= cpu->clock) {
+    run_engine(cpu, mode, cycle - cpu->clock + 1);
+  }
+  APEX_trace_flush(cpu);
+  if (cpu->end == 1) {
+    fprintf(cpu->config.out, "(apex) >> Simulation Complete");
   }
   display_reg_file(cpu);
   display_data_memory(cpu);
+  APEX_cpu_print_counters(cpu, cpu->config.out);
+  if (cpu->profile) {
+    APEX_cpu_print_profile(cpu, cpu->config.out);
+  }
+  if (APEX_intervals_close(cpu) != 0) {
+    APEX_cpu_message(cpu,
+                     "APEX_Error : Unable to write interval statistics %s\n",
+                     cpu->config.interval_file);
+  }
+  if (cpu->config.counters_file &&
+      APEX_cpu_write_counters(cpu, cpu->config.counters_file) != 0) {
+    APEX_cpu_message(cpu, "APEX_Error : Unable to write counters %s\n",
+                     cpu->config.counters_file);
+  }
   return 0;
 }
 
 
 void display_reg_file(APEX_CPU* cpu){
-  printf("=============== STATE OF ARCHITECTURAL REGISTER FILE ==========\n");
+  fprintf(cpu->config.out, "=============== STATE OF ARCHITECTURAL REGISTER FILE ==========\n");
   for(int i=0; i<16; i++){
-    if(cpu->regs_valid[i] == 1){
-      printf("|     REG[%2d]    |      Value=%6d     |     Status=Valid      \n",i,cpu->regs[i]);
-    } 
-    else if(cpu->regs_valid[i] == 0){
-      printf("|     REG[%2d]    |      Value=%6d     |     Status=Invalid    \n",i,cpu->regs[i]);
+    if(!(cpu->regs_pending & (1u << i))){
+      fprintf(cpu->config.out, "|     REG[%2d]    |      Value=%6d     |     Status=Valid      \n",i,cpu->regs[i]);
     } 
     else{
-      printf("|     REG[%2d]    |      Value=%6d     |     Status=Valid      \n",i,cpu->regs[i]);
-    }
+      fprintf(cpu->config.out, "|     REG[%2d]    |      Value=%6d     |     Status=Invalid    \n",i,cpu->regs[i]);
+    } 
   }
 }
 
 void display_data_memory(APEX_CPU* cpu){
-  printf("============== STATE OF DATA MEMORY =============\n");
-  for(int i=0; i<100; i++){
-    printf("|     MEM[%2d]     |     Data Value = %6d     |\n",i,cpu->data_memory[i]);
+  if (cpu->config.data_dump) {
+    if (APEX_cpu_dump_data(cpu, cpu->config.data_dump) != 0) {
+      APEX_cpu_message(cpu,
+                       "APEX_Error : Unable to write data memory image %s\n",
+                       cpu->config.data_dump);
+    }
+  }
+  else {
+    fprintf(cpu->config.out, "============== STATE OF DATA MEMORY =============\n");
+    for(int i=0; i<100 && i<cpu->data_memory_size; i++){
+      int value;
+      APEX_cpu_read_memory(cpu, i, &value);
+      fprintf(cpu->config.out, "|     MEM[%2d]     |     Data Value = %6d     |\n",i,value);
+    }
+  }
+  if (cpu->mem_faults) {
+    APEX_cpu_message(cpu,
+                     "APEX_Error : %lld data memory accesses out of range "
+                     "(0-%d), first at address %d\n",
+                     cpu->mem_faults, cpu->data_memory_size - 1,
+                     cpu->mem_fault_address);
   }
 }
\ No newline at end of file
@@ -1,5 +1,8 @@
 #ifndef _APEX_CPU_H_
 #define _APEX_CPU_H_
+
+#include <stddef.h>
+#include <stdio.h>
 /**
  *  cpu.h
  *  Contains various CPU and Pipeline Data structures
@@ -21,63 +24,252 @@ enum
   NUM_STAGES
 };
 
+/* Opcode IDs, resolved from the mnemonic once when code memory is built */
+enum
+{
+  OP_NONE,      // empty latch (bubble)
+  OP_MOVC,
+  OP_ADD,
+  OP_ADDL,
+  OP_SUB,
+  OP_SUBL,
+  OP_MUL,
+  OP_AND,
+  OP_OR,
+  OP_EXOR,
+  OP_LOAD,
+  OP_LDR,
+  OP_STORE,
+  OP_STR,
+  OP_BZ,
+  OP_BNZ,
+  OP_JUMP,
+  OP_HALT,
+  OP_UNKNOWN,   // mnemonic not recognised by the parser
+  NUM_OPCODES
+};
+
+/* Opcode class bits, used by the forwarding logic */
+enum
+{
+  OPC_ALU_FWD = 1 << 0,   // result forwardable from MEM1, MEM2 and WB
+  OPC_LOAD_FWD = 1 << 1,  // result forwardable from WB only
+  OPC_Z_FWD = 1 << 2,     // Z flag forwarded to BZ/BNZ by comparator_z
+};
+
+/* Causes of a cycle in which decode could not issue */
+enum
+{
+  STALL_NONE,	    // Sink for cycles without a stall, never reported
+  STALL_RAW,	    // Source register still being computed
+  STALL_Z,	        // BZ/BNZ waiting for the Z flag
+  STALL_FLUSH,	    // Instruction squashed behind a taken branch or JUMP
+  NUM_STALL_CAUSES
+};
+
 /* Format of an APEX instruction  */
 typedef struct APEX_Instruction
 {
-  char opcode[128];	// Operation Code
-  int rd;		    // Destination Register Address
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int rs3;
-  int imm;		    // Literal Value
+  unsigned char op;	        // Opcode ID
+  unsigned char op_class;	// Opcode class bits
+  unsigned char rd;	        // Destination Register Address
+  unsigned char rs1;	    // Source-1 Register Address
+  unsigned char rs2;	    // Source-2 Register Address
+  unsigned char rs3;
+  int imm;		            // Literal Value
 } APEX_Instruction;
 
-/* Model of CPU stage latch */
+/* Model of CPU stage latch
+ *
+ * Packed into 32 bytes so that all 8 latches share a few cache lines;
+ * register numbers and flags live in bit fields next to the opcode ID
+ */
 typedef struct CPU_Stage
 {
   int pc;		    // Program Counter
-  char opcode[128];	// Operation Code
-  int rs1;		    // Source-1 Register Address
-  int rs2;		    // Source-2 Register Address
-  int rs3;
-  int rd;		    // Destination Register Address
   int imm;		    // Literal Value
   int rs1_value;	// Source-1 Register Value
   int rs2_value;	// Source-2 Register Value
-  int rs3_value; //only used for instruction STR
+  int rs3_value;    // only used for instruction STR
   int buffer;		// Latch to hold some value
   int mem_address;	// Computed Memory Address
-  int busy;		    // Flag to indicate, stage is performing some action
-  int stalled;		// Flag to indicate, stage is stalled
-  int z; // for jump like instruction
-  int z_valid;
+  unsigned op : 5;	        // Opcode ID
+  unsigned op_class : 3;	// Opcode class bits
+  unsigned rd : 5;	        // Destination Register Address
+  unsigned rs1 : 5;	        // Source-1 Register Address
+  unsigned rs2 : 5;	        // Source-2 Register Address
+  unsigned rs3 : 5;
+  unsigned busy : 1;	    // Flag to indicate, stage is performing some action
+  unsigned stalled : 1;	    // Flag to indicate, stage is stalled
+  unsigned z : 1;	        // for jump like instruction
+  unsigned z_valid : 1;
 } CPU_Stage;
 
-/* Model of APEX CPU */
+/* Data memory is allocated in pages of DATA_PAGE_WORDS words (4 KB) */
+#define DATA_PAGE_SHIFT 10
+#define DATA_PAGE_WORDS (1 << DATA_PAGE_SHIFT)
+#define DEFAULT_DATA_MEMORY_SIZE 4096
+
+/* Parsed program, shared read-only by every CPU it is attached to */
+typedef struct APEX_Program
+{
+  APEX_Instruction* code_memory;
+  int code_memory_size;
+
+  /* Mapped program image backing code_memory, NULL if it was parsed */
+  void* code_image;
+  size_t code_image_len;
+
+  char* source;	    // Path of the .asm source, NULL for an image
+
+  int refs;	        // References held, updated atomically
+} APEX_Program;
+
+/* Performance counters of the pipeline, cleared by APEX_cpu_reset */
+typedef struct APEX_Counters
+{
+  long long committed;	    // Instructions retired by writeback
+  long long stalls[NUM_STALL_CAUSES];	// Cycles (flush: bubbles) by cause
+  long long forwards[NUM_STAGES];	    // Operands forwarded, by source latch;
+                                        // [0] counts register file reads
+  long long z_forwards[NUM_STAGES];	    // Z flags forwarded, by source latch
+  long long mix[NUM_OPCODES];	// Retired instructions by opcode
+} APEX_Counters;
+
+/* Profile of one instruction, charged while it sits in the pipeline */
+typedef struct APEX_Profile_Entry
+{
+  long long stage_cycles[NUM_STAGES];	// Cycles spent in each latch
+  long long stall_cycles;	// Cycles held in decode by a RAW or Z stall
+  long long flush_bubbles;	// Wrong-path instructions its branches squashed
+  long long taken;	        // Times its branch was taken
+  long long committed;	    // Times it retired
+  int target;	            // PC its branch last went to
+} APEX_Profile_Entry;
+
+/* Per-instance simulator settings, passed to APEX_cpu_create */
+typedef struct APEX_Config
+{
+  int trace;		    // Print per-cycle pipeline contents and code memory
+  long long trace_first;	// First and last cycle traced, 0 for no limit
+  long long trace_last;
+  int trace_pc_low;	    // Only trace stages holding a PC in this range,
+  int trace_pc_high;	// 0 for no limit
+  const char* trace_file;	// Write a binary trace here instead of text,
+                            // NULL for text
+  const char* counters_file;	// Export the counters here (.json or .csv)
+  int profile;	        // Profile the pipeline by PC and report hot spots
+  long long interval;	    // Cycles per row of interval statistics, 0 for none
+  const char* interval_file;	// Stream the interval rows here (.csv or binary)
+  FILE* out;		    // Stream receiving all simulator output
+  FILE* err;		    // Stream receiving errors and progress lines,
+                            // NULL for none
+  long long cycle_budget;	// APEX_cpu_step never advances the clock past this
+  int progress;	        // Seconds between progress lines on err, 0 for none
+  int data_memory_size;	    // Words of data memory, 0 for the default
+  const char* data_dump;	// Write the final data memory image here instead
+                            // of printing it, NULL to print
+
+  /* Sampled mode, 0 selects the default: instructions between samples,
+   * instructions committed to warm up the pipeline before a sample, and
+   * cycles measured per sample */
+  int sample_interval;
+  int sample_warmup;
+  int sample_length;
+} APEX_Config;
+
+/* CPI estimate of a sampled run */
+typedef struct APEX_Sample_Result
+{
+  long long instructions;	// Instructions executed in total
+  int samples;	        // Detailed windows that contributed
+  double cpi;	        // Mean CPI over the samples
+  double cpi_error;	    // Half width of the 95% confidence interval
+} APEX_Sample_Result;
+
+/* Model of APEX CPU
+ *
+ * All simulator state lives in this struct, so independent instances may
+ * run concurrently on different threads. A single instance must not be
+ * used from more than one thread at a time.
+ */
 typedef struct APEX_CPU
 {
+  APEX_Config config;
+
   /* Clock cycles elasped */
-  int clock;
+  long long clock;
 
   /* Current program counter */
   int pc;
 
   /* Integer register file */
   int regs[32];
-  int regs_valid[32];
+  unsigned int regs_pending;	// Bit per register with a writer in flight
+  unsigned int regs_written;	// Bit per register written since reset;
+                            // reading any other stalls until it is
+
+  /* Forwarding table, rebuilt by decode every cycle: latch holding the
+   * forwardable value of each register (0 if none), and latch holding
+   * the youngest Z-producing instruction (0 if none) */
+  unsigned char fwd[32];
+  int fwd_z;
 
   /* Array of 5 CPU_stage */
   CPU_Stage stage[8];
 
-  /* Code Memory where instructions are stored */
+  /* Code Memory where instructions are stored, borrowed from program */
+  APEX_Program* program;
   APEX_Instruction* code_memory;
   int code_memory_size;
 
-  /* Data Memory */
-  int data_memory[4096];
+  /* Code memory pre-translated for the threaded engine, built lazily */
+  struct Threaded_Instruction* threaded_code;
+
+  /* Basic blocks translated by the block engine, built lazily */
+  struct Block_Cache* block_cache;
+
+  /* Background writer of the pipeline trace, started by the first traced
+   * cycle, and the record of the cycle being traced (NULL if none) */
+  struct APEX_Trace* trace_writer;
+  struct APEX_Trace_Record* trace_record;
+
+  /* Data Memory: data_memory_size words, in pages allocated on the first
+   * store to them (NULL pages read as zero) */
+  int** data_pages;
+  int num_data_pages;
+  int data_memory_size;
+
+  /* Bit per page that may hold a non-zero word, set by every store; pages
+   * with a clear bit are all zero, so dumps, snapshots and resets only
+   * visit the dirty ones */
+  unsigned long long* data_dirty;
+
+  /* Copy-on-write mapping of a preload image, backing the pages inside
+   * it, NULL if none */
+  void* data_image;
+  size_t data_image_len;
+
+  /* Out-of-range data memory accesses, which are otherwise ignored */
+  long long mem_faults;
+  int mem_fault_address;	// Address of the first one
 
   /* Some stats */
-  int ins_completed;
+  long long ins_completed;
+  long long stall_cycles;	// Cycles that ended with fetch stalled
+  APEX_Counters counters;
+  int stall_cause;	        // Why decode stalled this cycle, STALL_NONE if not
+
+  /* Per-instruction profile with config.profile set, one entry per
+   * instruction of the program, allocated by the first profiled cycle */
+  APEX_Profile_Entry* profile;
+  int profile_size;
+
+  /* Interval statistics with config.interval set, opened by the first
+   * cycle, and the cycle count at which the next row is due (LLONG_MAX if
+   * none) */
+  struct APEX_Intervals* intervals;
+  long long interval_next;
 
   int z;
   int z_valid;
@@ -85,18 +277,229 @@ typedef struct APEX_CPU
   int end;
 } APEX_CPU;
 
+int
+create_data_memory(APEX_CPU* cpu, int size);
+
+void
+free_data_memory(APEX_CPU* cpu);
+
+void
+clear_data_memory(APEX_CPU* cpu);
+
+int
+copy_data_memory(APEX_CPU* dst, const APEX_CPU* src);
+
+int*
+alloc_data_page(APEX_CPU* cpu, int address);
+
+int
+next_dirty_page(const APEX_CPU* cpu, int index);
+
+void
+data_memory_fault(APEX_CPU* cpu, int address);
+
+int
+load_data_slow(APEX_CPU* cpu, int address);
+
+void
+store_data_slow(APEX_CPU* cpu, int address, int value);
+
+unsigned int
+data_memory_checksum(const APEX_CPU* cpu);
+
+/* Instructions in the attached program. Taken branches adjust
+ * code_memory_size, so code is bounded and translated by this instead */
+static inline int
+program_length(const APEX_CPU* cpu)
+{
+  return cpu->program ? cpu->program->code_memory_size : cpu->code_memory_size;
+}
+
+/*
+ * Loads the data memory word at address. The engines pass cpu's page
+ * table and size in locals so that they stay in registers; anything but
+ * an in-range load from an allocated page takes the slow path, which
+ * reads unallocated pages as zero and counts out-of-range faults.
+ */
+static inline int
+load_data_word(APEX_CPU* cpu, int* const* pages, unsigned int size,
+               int address)
+{
+  const int* page;
+  if ((unsigned int)address >= size ||
+      !(page = pages[address >> DATA_PAGE_SHIFT])) {
+    return load_data_slow(cpu, address);
+  }
+  return page[address & (DATA_PAGE_WORDS - 1)];
+}
+
+/* Records that the page holding address may hold non-zero words */
+static inline void
+mark_data_dirty(APEX_CPU* cpu, int address)
+{
+  unsigned int index = (unsigned int)address >> DATA_PAGE_SHIFT;
+  cpu->data_dirty[index >> 6] |= 1ULL << (index & 63);
+}
+
+/*
+ * Stores value at address, with the same fast path as load_data_word.
+ * The slow path allocates pages on first use and drops out-of-range
+ * stores.
+ */
+static inline void
+store_data_word(APEX_CPU* cpu, int* const* pages, unsigned int size,
+                int address, int value)
+{
+  int* page;
+  if ((unsigned int)address >= size ||
+      !(page = pages[address >> DATA_PAGE_SHIFT])) {
+    store_data_slow(cpu, address, value);
+    return;
+  }
+  page[address & (DATA_PAGE_WORDS - 1)] = value;
+  mark_data_dirty(cpu, address);
+}
+
+static inline int
+read_data_memory(APEX_CPU* cpu, int address)
+{
+  return load_data_word(cpu, cpu->data_pages, cpu->data_memory_size, address);
+}
+
+static inline void
+write_data_memory(APEX_CPU* cpu, int address, int value)
+{
+  store_data_word(cpu, cpu->data_pages, cpu->data_memory_size, address, value);
+}
+
+const char*
+get_opcode_name(int op);
+
+APEX_Instruction*
+create_code_memory(const char* filename, int* size, FILE* err);
+
+unsigned int
+apex_checksum(const void* data, size_t len);
+
+unsigned int
+apex_checksum_update(unsigned int hash, const void* data, size_t len);
+
+int
+parse_count(const char* text, long long* count);
+
+int
+read_source_lines(const char* filename, int count, int* lines, char** texts);
+
+int
+is_code_image(const char* filename);
+
+int
+write_code_image(const char* filename, const APEX_Instruction* code, int size);
+
 APEX_Instruction*
-create_code_memory(const char* filename, int* size);
+map_code_image(const char* filename, int* size, void** mapping,
+               size_t* mapping_len);
+
+APEX_Program*
+APEX_program_load(const char* filename, FILE* err);
+
+APEX_Program*
+APEX_program_retain(APEX_Program* program);
+
+void
+APEX_program_release(APEX_Program* program);
+
+APEX_CPU*
+APEX_cpu_create(const APEX_Config* config);
+
+APEX_CPU*
+APEX_cpu_open(const char* filename, const APEX_Config* config);
 
 APEX_CPU*
 APEX_cpu_init(const char* filename);
 
 int
-APEX_cpu_run(APEX_CPU* cpu, int mode, int cycle);
+APEX_cpu_load(APEX_CPU* cpu, const char* filename);
+
+void
+APEX_cpu_attach(APEX_CPU* cpu, APEX_Program* program);
+
+void
+APEX_cpu_reset(APEX_CPU* cpu);
+
+void
+APEX_cpu_leave_pipeline(APEX_CPU* cpu);
+
+int
+APEX_cpu_run(APEX_CPU* cpu, int mode, long long cycle);
+
+long long
+APEX_cpu_step(APEX_CPU* cpu, long long cycles);
+
+int
+APEX_cpu_finished(const APEX_CPU* cpu);
+
+void
+APEX_cpu_message(const APEX_CPU* cpu, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+int
+APEX_cpu_read_reg(const APEX_CPU* cpu, int reg, int* value);
+
+int
+APEX_cpu_read_memory(const APEX_CPU* cpu, int address, int* value);
+
+int
+APEX_cpu_load_data(APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_dump_data(const APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_save(const APEX_CPU* cpu, const char* filename);
+
+int
+APEX_cpu_restore(APEX_CPU* cpu, const char* filename);
 
 void
 APEX_cpu_stop(APEX_CPU* cpu);
 
+long long
+APEX_functional_run(APEX_CPU* cpu, long long count);
+
+long long
+APEX_threaded_run(APEX_CPU* cpu, long long count);
+
+long long
+APEX_block_run(APEX_CPU* cpu, long long count);
+
+long long
+APEX_sample_run(APEX_CPU* cpu, long long count, APEX_Sample_Result* result);
+
+void
+APEX_trace_begin_cycle(APEX_CPU* cpu);
+
+void
+APEX_trace_end_cycle(APEX_CPU* cpu);
+
+void
+APEX_trace_stage(APEX_CPU* cpu, int stage);
+
+void
+APEX_trace_flush(APEX_CPU* cpu);
+
+void
+APEX_trace_close(APEX_CPU* cpu);
+
+int
+APEX_trace_decode(FILE* in, FILE* out, int csv);
+
+void
+APEX_block_cache_free(struct Block_Cache* cache);
+
+int
+get_code_index(int pc);
+
 int
 fetch(APEX_CPU* cpu);
 
@@ -118,6 +521,45 @@ memory2(APEX_CPU* cpu);
 int
 writeback(APEX_CPU* cpu);
 
+int
+comparator(APEX_CPU* cpu, int r_name, int* rs_value);
+
+void
+APEX_cpu_print_counters(const APEX_CPU* cpu, FILE* out);
+
+int
+APEX_profile_start(APEX_CPU* cpu);
+
+void
+APEX_profile_cycles(APEX_CPU* cpu, long long cycles);
+
+void
+APEX_profile_branch(APEX_CPU* cpu, const CPU_Stage* branch, int bubbles);
+
+void
+APEX_profile_commit(APEX_CPU* cpu, const CPU_Stage* stage);
+
+void
+APEX_profile_free(APEX_CPU* cpu);
+
+void
+APEX_cpu_print_profile(const APEX_CPU* cpu, FILE* out);
+
+int
+APEX_intervals_open(APEX_CPU* cpu);
+
+void
+APEX_intervals_sample(APEX_CPU* cpu);
+
+void
+APEX_intervals_restart(APEX_CPU* cpu);
+
+int
+APEX_intervals_close(APEX_CPU* cpu);
+
+int
+APEX_cpu_write_counters(const APEX_CPU* cpu, const char* filename);
+
 void
 display_reg_file(APEX_CPU* cpu);
 
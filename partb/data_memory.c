@@ -0,0 +1,388 @@
+/*
+ *  data_memory.c
+ *  Contains the paged data memory. The address space of data_memory_size
+ *  words is split into DATA_PAGE_WORDS-word pages that are allocated on
+ *  the first store to them; pages never stored to read as zero, so a
+ *  large memory costs only what the program touches. A bitmap marks the
+ *  pages that may hold non-zero words, so everything that walks memory
+ *  costs time in proportion to what the program touched as well.
+ *
+ *  Loads and stores outside the address space are counted as faults and
+ *  otherwise ignored (a faulting load reads zero).
+ *
+ *  Memory can be preloaded from an image file, either binary (native
+ *  32-bit words) or text (".hex", one hexadecimal word per line), both
+ *  starting at address 0. A binary image is mapped copy-on-write and its
+ *  pages are used in place, so loading costs nothing until the program
+ *  touches the data.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+
+/*
+ * Sets up an empty data memory of size words.
+ *
+ * Returns 0 on success, -1 if size is invalid or allocation fails
+ */
+int
+create_data_memory(APEX_CPU* cpu, int size)
+{
+  if (size <= 0) {
+    return -1;
+  }
+  int num_pages = (size - 1) / DATA_PAGE_WORDS + 1;
+  cpu->data_pages = calloc(num_pages, sizeof(int*));
+  cpu->data_dirty = calloc((num_pages - 1) / 64 + 1,
+                           sizeof(unsigned long long));
+  if (!cpu->data_pages || !cpu->data_dirty) {
+    free(cpu->data_pages);
+    free(cpu->data_dirty);
+    return -1;
+  }
+  cpu->data_memory_size = size;
+  cpu->num_data_pages = num_pages;
+  cpu->data_image = NULL;
+  cpu->data_image_len = 0;
+  cpu->mem_faults = 0;
+  cpu->mem_fault_address = 0;
+  return 0;
+}
+
+static int
+is_image_page(const APEX_CPU* cpu, const int* page)
+{
+  const char* image = cpu->data_image;
+  return image && (const char*)page >= image &&
+         (const char*)page < image + cpu->data_image_len;
+}
+
+/* Drops the pages backed by the preload image and unmaps it */
+static void
+unmap_data_image(APEX_CPU* cpu)
+{
+  if (!cpu->data_image) {
+    return;
+  }
+  for (int i = 0; i < cpu->num_data_pages; ++i) {
+    if (is_image_page(cpu, cpu->data_pages[i])) {
+      cpu->data_pages[i] = NULL;
+    }
+  }
+  munmap(cpu->data_image, cpu->data_image_len);
+  cpu->data_image = NULL;
+  cpu->data_image_len = 0;
+}
+
+void
+free_data_memory(APEX_CPU* cpu)
+{
+  unmap_data_image(cpu);
+  for (int i = 0; i < cpu->num_data_pages; ++i) {
+    free(cpu->data_pages[i]);
+  }
+  free(cpu->data_pages);
+  free(cpu->data_dirty);
+  cpu->data_pages = NULL;
+  cpu->data_dirty = NULL;
+  cpu->num_data_pages = 0;
+}
+
+/*
+ * Returns the first dirty page at or after index, or num_data_pages if
+ * there is none
+ */
+int
+next_dirty_page(const APEX_CPU* cpu, int index)
+{
+  while (index < cpu->num_data_pages) {
+    unsigned long long bits = cpu->data_dirty[index >> 6] >> (index & 63);
+    if (bits) {
+      return index + __builtin_ctzll(bits);
+    }
+    index = (index | 63) + 1;
+  }
+  return cpu->num_data_pages;
+}
+
+/*
+ * Zeroes every word and clears the fault count. Pages stay allocated, so
+ * a program re-run on the same CPU does not allocate again; a preload
+ * image is dropped.
+ */
+void
+clear_data_memory(APEX_CPU* cpu)
+{
+  unmap_data_image(cpu);
+  for (int i = next_dirty_page(cpu, 0); i < cpu->num_data_pages;
+       i = next_dirty_page(cpu, i + 1)) {
+    if (cpu->data_pages[i]) {
+      memset(cpu->data_pages[i], 0, sizeof(int) * DATA_PAGE_WORDS);
+    }
+  }
+  memset(cpu->data_dirty, 0,
+         sizeof(unsigned long long) * ((cpu->num_data_pages - 1) / 64 + 1));
+  cpu->mem_faults = 0;
+  cpu->mem_fault_address = 0;
+}
+
+/*
+ * Makes the data memory of dst a copy of src's. Both must have the same
+ * size.
+ *
+ * Returns 0 on success, -1 on a size mismatch or allocation failure
+ */
+int
+copy_data_memory(APEX_CPU* dst, const APEX_CPU* src)
+{
+  if (dst->data_memory_size != src->data_memory_size) {
+    return -1;
+  }
+  /* Only pages dirty on either side can differ */
+  int words = (src->num_data_pages - 1) / 64 + 1;
+  for (int w = 0; w < words; ++w) {
+    unsigned long long bits = src->data_dirty[w] | dst->data_dirty[w];
+    for (; bits; bits &= bits - 1) {
+      int i = w * 64 + __builtin_ctzll(bits);
+      if (src->data_pages[i]) {
+        if (!dst->data_pages[i] &&
+            !alloc_data_page(dst, i * DATA_PAGE_WORDS)) {
+          return -1;
+        }
+        memcpy(dst->data_pages[i], src->data_pages[i],
+               sizeof(int) * DATA_PAGE_WORDS);
+      }
+      else if (dst->data_pages[i]) {
+        memset(dst->data_pages[i], 0, sizeof(int) * DATA_PAGE_WORDS);
+      }
+    }
+    dst->data_dirty[w] = src->data_dirty[w];
+  }
+  dst->mem_faults = src->mem_faults;
+  dst->mem_fault_address = src->mem_fault_address;
+  return 0;
+}
+
+/*
+ * Allocates the zeroed page holding address, which must be in range and
+ * not yet allocated.
+ *
+ * Returns the page, or NULL (counted as a fault) if allocation fails
+ */
+int*
+alloc_data_page(APEX_CPU* cpu, int address)
+{
+  int* page = calloc(DATA_PAGE_WORDS, sizeof(int));
+  if (!page) {
+    data_memory_fault(cpu, address);
+    return NULL;
+  }
+  cpu->data_pages[address >> DATA_PAGE_SHIFT] = page;
+  return page;
+}
+
+int
+load_data_slow(APEX_CPU* cpu, int address)
+{
+  if ((unsigned int)address >= (unsigned int)cpu->data_memory_size) {
+    data_memory_fault(cpu, address);
+    return 0;
+  }
+  const int* page = cpu->data_pages[address >> DATA_PAGE_SHIFT];
+  return page ? page[address & (DATA_PAGE_WORDS - 1)] : 0;
+}
+
+void
+store_data_slow(APEX_CPU* cpu, int address, int value)
+{
+  if ((unsigned int)address >= (unsigned int)cpu->data_memory_size) {
+    data_memory_fault(cpu, address);
+    return;
+  }
+  int* page = cpu->data_pages[address >> DATA_PAGE_SHIFT];
+  if (!page && !(page = alloc_data_page(cpu, address))) {
+    return;
+  }
+  page[address & (DATA_PAGE_WORDS - 1)] = value;
+  mark_data_dirty(cpu, address);
+}
+
+void
+data_memory_fault(APEX_CPU* cpu, int address)
+{
+  if (cpu->mem_faults++ == 0) {
+    cpu->mem_fault_address = address;
+  }
+}
+
+/*
+ * FNV-1a over the index and contents of every page holding a non-zero
+ * word, so that equal memories hash equally however they were touched
+ */
+unsigned int
+data_memory_checksum(const APEX_CPU* cpu)
+{
+  static const int zero_page[DATA_PAGE_WORDS];
+  unsigned int hash = apex_checksum(NULL, 0);
+  for (int i = next_dirty_page(cpu, 0); i < cpu->num_data_pages;
+       i = next_dirty_page(cpu, i + 1)) {
+    const int* page = cpu->data_pages[i];
+    if (!page || memcmp(page, zero_page, sizeof(zero_page)) == 0) {
+      continue;
+    }
+    hash = apex_checksum_update(hash, &i, sizeof(i));
+    hash = apex_checksum_update(hash, page, sizeof(int) * DATA_PAGE_WORDS);
+  }
+  return hash;
+}
+
+static int
+is_hex_image(const char* filename)
+{
+  const char* ext = strrchr(filename, '.');
+  return ext && strcmp(ext, ".hex") == 0;
+}
+
+/*
+ * Maps a binary image copy-on-write and points the pages it covers into
+ * the mapping. The tail of the last page past the end of the file reads
+ * as zero.
+ */
+static int
+map_data_image(APEX_CPU* cpu, const char* filename)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size % sizeof(int) != 0 ||
+      st.st_size / sizeof(int) > (size_t)cpu->data_memory_size) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+
+  cpu->data_image = base;
+  cpu->data_image_len = st.st_size;
+  size_t page_bytes = sizeof(int) * DATA_PAGE_WORDS;
+  int num_pages = (st.st_size - 1) / page_bytes + 1;
+  for (int i = 0; i < num_pages; ++i) {
+    free(cpu->data_pages[i]);
+    cpu->data_pages[i] = (int*)((char*)base + i * page_bytes);
+    mark_data_dirty(cpu, i * DATA_PAGE_WORDS);
+  }
+  return 0;
+}
+
+/* Reads a text image of whitespace-separated hexadecimal words */
+static int
+read_hex_image(APEX_CPU* cpu, const char* filename)
+{
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    return -1;
+  }
+  unsigned int word;
+  int address = 0;
+  int ok = 1;
+  int n;
+  while ((n = fscanf(fp, "%x", &word)) == 1) {
+    if (address >= cpu->data_memory_size) {
+      ok = 0;
+      break;
+    }
+    store_data_slow(cpu, address++, (int)word);
+  }
+  if (n == 0) {
+    ok = 0;
+  }
+  fclose(fp);
+  return ok ? 0 : -1;
+}
+
+/*
+ * Replaces data memory with the image in filename, binary unless the name
+ * ends in ".hex". Words past the end of the image are zero.
+ *
+ * Returns 0 on success, -1 if the file is unreadable, malformed or larger
+ * than data memory, in which case memory is left zeroed
+ */
+int
+APEX_cpu_load_data(APEX_CPU* cpu, const char* filename)
+{
+  clear_data_memory(cpu);
+  int status = is_hex_image(filename) ? read_hex_image(cpu, filename)
+                                      : map_data_image(cpu, filename);
+  if (status != 0) {
+    clear_data_memory(cpu);
+  }
+  return status;
+}
+
+/*
+ * Writes data memory to filename in the format APEX_cpu_load_data reads,
+ * up to the last non-zero word.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_cpu_dump_data(const APEX_CPU* cpu, const char* filename)
+{
+  static const int zero_page[DATA_PAGE_WORDS];
+  int hex = is_hex_image(filename);
+  FILE* fp = fopen(filename, hex ? "w" : "wb");
+  if (!fp) {
+    return -1;
+  }
+
+  /* Number of words to write, up to the last non-zero one */
+  int len = 0;
+  for (int i = next_dirty_page(cpu, 0); i < cpu->num_data_pages;
+       i = next_dirty_page(cpu, i + 1)) {
+    const int* page = cpu->data_pages[i];
+    for (int j = DATA_PAGE_WORDS - 1; page && j >= 0; --j) {
+      if (page[j]) {
+        len = i * DATA_PAGE_WORDS + j + 1;
+        break;
+      }
+    }
+  }
+
+  int ok = 1;
+  for (int base = 0; ok && base < len; base += DATA_PAGE_WORDS) {
+    int index = base >> DATA_PAGE_SHIFT;
+    const int* page = cpu->data_pages[index];
+    int count = len - base < DATA_PAGE_WORDS ? len - base : DATA_PAGE_WORDS;
+    if (!page || !(cpu->data_dirty[index >> 6] >> (index & 63) & 1)) {
+      page = zero_page;
+    }
+    if (hex) {
+      for (int j = 0; ok && j < count; ++j) {
+        ok = fprintf(fp, "%08x\n", (unsigned int)page[j]) > 0;
+      }
+    }
+    else {
+      ok = fwrite(page, sizeof(int), count, fp) == count;
+    }
+  }
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
@@ -0,0 +1,333 @@
+/*
+ *  functional.c
+ *  Contains the functional (ISA-only) APEX simulator. Instructions are
+ *  executed one per step straight from code memory, without modelling
+ *  the pipeline, so only the final architectural state is meaningful.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/*
+ * Executes up to count instructions starting at cpu->pc, or at the oldest
+ * instruction in flight if the pipeline left some. Stops early on HALT or
+ * when the PC leaves code memory, and sets cpu->end in that case.
+ *
+ * Returns the number of instructions executed
+ */
+long long
+APEX_functional_run(APEX_CPU* cpu, long long count)
+{
+  APEX_cpu_leave_pipeline(cpu);
+  const APEX_Instruction* code = cpu->code_memory;
+  int size = program_length(cpu);
+  int* regs = cpu->regs;
+  int* const* pages = cpu->data_pages;
+  unsigned int mem_size = cpu->data_memory_size;
+  int pc = cpu->pc;
+  int z = cpu->z;
+  long long executed = 0;
+
+  while (executed < count) {
+    int index = get_code_index(pc);
+    if (index < 0 || index >= size) {
+      cpu->end = 1;
+      break;
+    }
+
+    const APEX_Instruction* ins = &code[index];
+    executed++;
+
+    switch (ins->op) {
+      case OP_MOVC:
+        regs[ins->rd] = ins->imm;
+        break;
+
+      case OP_ADD:
+        regs[ins->rd] = regs[ins->rs1] + regs[ins->rs2];
+        z = regs[ins->rd] == 0;
+        break;
+
+      case OP_ADDL:
+        regs[ins->rd] = regs[ins->rs1] + ins->imm;
+        z = regs[ins->rd] == 0;
+        break;
+
+      case OP_SUB:
+        regs[ins->rd] = regs[ins->rs1] - regs[ins->rs2];
+        z = regs[ins->rd] == 0;
+        break;
+
+      case OP_SUBL:
+        regs[ins->rd] = regs[ins->rs1] - ins->imm;
+        z = regs[ins->rd] == 0;
+        break;
+
+      case OP_MUL:
+        regs[ins->rd] = regs[ins->rs1] * regs[ins->rs2];
+        z = regs[ins->rd] == 0;
+        break;
+
+      case OP_AND:
+        regs[ins->rd] = regs[ins->rs1] & regs[ins->rs2];
+        break;
+
+      case OP_OR:
+        regs[ins->rd] = regs[ins->rs1] | regs[ins->rs2];
+        break;
+
+      case OP_EXOR:
+        regs[ins->rd] = regs[ins->rs1] ^ regs[ins->rs2];
+        break;
+
+      case OP_LOAD:
+        regs[ins->rd] = load_data_word(cpu, pages, mem_size,
+                                       regs[ins->rs1] + ins->imm);
+        break;
+
+      case OP_LDR:
+        regs[ins->rd] = load_data_word(cpu, pages, mem_size,
+                                       regs[ins->rs1] + regs[ins->rs2]);
+        break;
+
+      case OP_STORE:
+        store_data_word(cpu, pages, mem_size,
+                        regs[ins->rs2] + ins->imm, regs[ins->rs1]);
+        break;
+
+      case OP_STR: // [<src2> + <src3>] <- src1
+        store_data_word(cpu, pages, mem_size,
+                        regs[ins->rs2] + regs[ins->rs3], regs[ins->rs1]);
+        break;
+
+      case OP_BZ:
+        if (z) {
+          pc += ins->imm;
+          continue;
+        }
+        break;
+
+      case OP_BNZ:
+        if (!z) {
+          pc += ins->imm;
+          continue;
+        }
+        break;
+
+      case OP_JUMP:
+        pc = regs[ins->rs1] + ins->imm;
+        continue;
+
+      case OP_HALT:
+        cpu->end = 1;
+        count = executed;
+        break;
+    }
+    pc += 4;
+  }
+
+  cpu->pc = pc;
+  cpu->z = z;
+  cpu->z_valid = 1;
+  cpu->ins_completed += executed;
+  return executed;
+}
+
+/* One entry of the threaded code stream */
+typedef struct Threaded_Instruction
+{
+  const void* handler;	// Address of the handler executing this instruction
+  int imm;		        // Literal Value
+  int target;		    // Code index of a BZ/BNZ target, size if outside
+  unsigned char rd;
+  unsigned char rs1;
+  unsigned char rs2;
+  unsigned char rs3;
+} Threaded_Instruction;
+
+/*
+ * Translates code memory into the threaded code stream. Entry size is a
+ * sentinel that leaves the interpreter, and every branch that lands
+ * outside code memory is pointed at it.
+ */
+static Threaded_Instruction*
+create_threaded_code(APEX_CPU* cpu, const void* const* handlers)
+{
+  int size = program_length(cpu);
+  Threaded_Instruction* code = calloc(size + 1, sizeof(*code));
+  if (!code) {
+    return NULL;
+  }
+
+  for (int i = 0; i < size; ++i) {
+    const APEX_Instruction* ins = &cpu->code_memory[i];
+    Threaded_Instruction* t = &code[i];
+    t->handler = handlers[ins->op];
+    t->imm = ins->imm;
+    t->rd = ins->rd;
+    t->rs1 = ins->rs1;
+    t->rs2 = ins->rs2;
+    t->rs3 = ins->rs3;
+    t->target = get_code_index(4000 + 4 * i + ins->imm);
+    if (t->target < 0 || t->target >= size) {
+      t->target = size;
+    }
+  }
+  code[size].handler = handlers[NUM_OPCODES];
+  return code;
+}
+
+/*
+ * Same contract as APEX_functional_run, but executes a pre-translated
+ * threaded code stream and jumps straight from one handler to the next
+ * with GCC's labels-as-values instead of going through a central switch.
+ */
+long long
+APEX_threaded_run(APEX_CPU* cpu, long long count)
+{
+#if defined(__GNUC__)
+  static const void* const handlers[NUM_OPCODES + 1] = {
+    [OP_NONE] = &&op_nop,   [OP_MOVC] = &&op_movc, [OP_ADD] = &&op_add,
+    [OP_ADDL] = &&op_addl,  [OP_SUB] = &&op_sub,   [OP_SUBL] = &&op_subl,
+    [OP_MUL] = &&op_mul,    [OP_AND] = &&op_and,   [OP_OR] = &&op_or,
+    [OP_EXOR] = &&op_exor,  [OP_LOAD] = &&op_load, [OP_LDR] = &&op_ldr,
+    [OP_STORE] = &&op_store, [OP_STR] = &&op_str,  [OP_BZ] = &&op_bz,
+    [OP_BNZ] = &&op_bnz,    [OP_JUMP] = &&op_jump, [OP_HALT] = &&op_halt,
+    [OP_UNKNOWN] = &&op_nop, [NUM_OPCODES] = &&op_exit,
+  };
+
+  APEX_cpu_leave_pipeline(cpu);
+  if (!cpu->threaded_code) {
+    cpu->threaded_code = create_threaded_code(cpu, handlers);
+    if (!cpu->threaded_code) {
+      return APEX_functional_run(cpu, count);
+    }
+  }
+
+  const Threaded_Instruction* code = cpu->threaded_code;
+  int size = program_length(cpu);
+  int* regs = cpu->regs;
+  int* const* pages = cpu->data_pages;
+  unsigned int mem_size = cpu->data_memory_size;
+  int z = cpu->z;
+  long long executed = 0;
+
+  int index = get_code_index(cpu->pc);
+  const Threaded_Instruction* ip = &code[index < 0 || index >= size ? size : index];
+
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    if (executed == count) {                                                   \
+      goto out;                                                                \
+    }                                                                          \
+    executed++;                                                                \
+    goto* ip->handler;                                                         \
+  } while (0)
+
+#define NEXT()                                                                 \
+  do {                                                                         \
+    ip++;                                                                      \
+    DISPATCH();                                                                \
+  } while (0)
+
+  DISPATCH();
+
+op_nop:
+  NEXT();
+
+op_movc:
+  regs[ip->rd] = ip->imm;
+  NEXT();
+
+op_add:
+  regs[ip->rd] = regs[ip->rs1] + regs[ip->rs2];
+  z = regs[ip->rd] == 0;
+  NEXT();
+
+op_addl:
+  regs[ip->rd] = regs[ip->rs1] + ip->imm;
+  z = regs[ip->rd] == 0;
+  NEXT();
+
+op_sub:
+  regs[ip->rd] = regs[ip->rs1] - regs[ip->rs2];
+  z = regs[ip->rd] == 0;
+  NEXT();
+
+op_subl:
+  regs[ip->rd] = regs[ip->rs1] - ip->imm;
+  z = regs[ip->rd] == 0;
+  NEXT();
+
+op_mul:
+  regs[ip->rd] = regs[ip->rs1] * regs[ip->rs2];
+  z = regs[ip->rd] == 0;
+  NEXT();
+
+op_and:
+  regs[ip->rd] = regs[ip->rs1] & regs[ip->rs2];
+  NEXT();
+
+op_or:
+  regs[ip->rd] = regs[ip->rs1] | regs[ip->rs2];
+  NEXT();
+
+op_exor:
+  regs[ip->rd] = regs[ip->rs1] ^ regs[ip->rs2];
+  NEXT();
+
+op_load:
+  regs[ip->rd] = load_data_word(cpu, pages, mem_size, regs[ip->rs1] + ip->imm);
+  NEXT();
+
+op_ldr:
+  regs[ip->rd] = load_data_word(cpu, pages, mem_size,
+                                regs[ip->rs1] + regs[ip->rs2]);
+  NEXT();
+
+op_store:
+  store_data_word(cpu, pages, mem_size, regs[ip->rs2] + ip->imm, regs[ip->rs1]);
+  NEXT();
+
+op_str:
+  store_data_word(cpu, pages, mem_size,
+                  regs[ip->rs2] + regs[ip->rs3], regs[ip->rs1]);
+  NEXT();
+
+op_bz:
+  ip = z ? &code[ip->target] : ip + 1;
+  DISPATCH();
+
+op_bnz:
+  ip = !z ? &code[ip->target] : ip + 1;
+  DISPATCH();
+
+op_jump:
+  index = get_code_index(regs[ip->rs1] + ip->imm);
+  ip = &code[index < 0 || index >= size ? size : index];
+  DISPATCH();
+
+op_halt:
+  cpu->end = 1;
+  ip++;
+  goto out;
+
+op_exit:
+  /* Leaving code memory is not an instruction */
+  executed--;
+  cpu->end = 1;
+
+out:
+#undef NEXT
+#undef DISPATCH
+  cpu->pc = 4000 + 4 * (int)(ip - code);
+  cpu->z = z;
+  cpu->z_valid = 1;
+  cpu->ins_completed += executed;
+  return executed;
+#else
+  return APEX_functional_run(cpu, count);
+#endif
+}
@@ -0,0 +1,200 @@
+/*
+ *  intervals.c
+ *  Contains the interval statistics of long pipeline runs. With
+ *  config.interval set, the performance counters are sampled every
+ *  config.interval cycles and the difference since the last sample is
+ *  streamed to config.interval_file as one row, so phases of a run show
+ *  up without keeping anything in memory but the last sample.
+ *
+ *  Each row holds the cycle count at its end and, over the interval, the
+ *  cycles, committed instructions, decode stalls by cause, flush bubbles,
+ *  committed branches (BZ, BNZ, JUMP), loads and stores. The file is CSV,
+ *  with an ipc column after committed, if its name ends in ".csv". It is
+ *  otherwise binary: the magic "APXI", a 32-bit version and a 32-bit
+ *  column count, the column names each ending in a NUL, then one 64-bit
+ *  integer per column and row, all in host byte order.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "cpu.h"
+
+#define APEX_INTERVALS_MAGIC "APXI"
+#define APEX_INTERVALS_VERSION 1
+
+enum
+{
+  COL_CYCLE,
+  COL_CYCLES,
+  COL_COMMITTED,
+  COL_STALL_RAW,
+  COL_STALL_Z,
+  COL_FLUSH_BUBBLES,
+  COL_BRANCHES,
+  COL_LOADS,
+  COL_STORES,
+  NUM_COLUMNS
+};
+
+static const char* column_names[NUM_COLUMNS] = {
+  "cycle", "cycles", "committed", "stall_raw", "stall_z", "flush_bubbles",
+  "branches", "loads", "stores",
+};
+
+/* Writer of the interval rows of one CPU */
+typedef struct APEX_Intervals
+{
+  FILE* out;
+  int csv;
+  long long last_cycle;	    // Cycles elapsed at the last sample
+  APEX_Counters last;	    // Counters at the last sample
+} APEX_Intervals;
+
+/* Committed instructions of either opcode */
+static long long
+mix(const APEX_Counters* counters, int op1, int op2)
+{
+  return counters->mix[op1] + counters->mix[op2];
+}
+
+/* Starts a new interval at the current cycle */
+static void
+take_sample(APEX_CPU* cpu)
+{
+  APEX_Intervals* intervals = cpu->intervals;
+  long long cycle = cpu->clock - 1;
+  intervals->last_cycle = cycle;
+  intervals->last = cpu->counters;
+  long long interval = cpu->config.interval;
+  cpu->interval_next = (cycle / interval + 1) * interval;
+}
+
+/*
+ * Opens config.interval_file and starts the first interval, if
+ * config.interval asks for interval statistics and they are not open yet.
+ *
+ * Returns 0 on success, -1 if the file could not be written
+ */
+int
+APEX_intervals_open(APEX_CPU* cpu)
+{
+  if (cpu->intervals || cpu->config.interval <= 0 ||
+      !cpu->config.interval_file) {
+    return 0;
+  }
+  const char* filename = cpu->config.interval_file;
+  const char* ext = strrchr(filename, '.');
+  APEX_Intervals* intervals = malloc(sizeof(*intervals));
+  if (!intervals) {
+    return -1;
+  }
+  intervals->csv = ext && strcmp(ext, ".csv") == 0;
+  intervals->out = fopen(filename, intervals->csv ? "w" : "wb");
+  if (!intervals->out) {
+    free(intervals);
+    return -1;
+  }
+
+  if (intervals->csv) {
+    for (int i = 0; i < NUM_COLUMNS; ++i) {
+      fprintf(intervals->out, "%s%s", i ? "," : "", column_names[i]);
+      if (i == COL_COMMITTED) {
+        fprintf(intervals->out, ",ipc");
+      }
+    }
+    fprintf(intervals->out, "\n");
+  }
+  else {
+    unsigned int header[2] = { APEX_INTERVALS_VERSION, NUM_COLUMNS };
+    fwrite(APEX_INTERVALS_MAGIC, 1, 4, intervals->out);
+    fwrite(header, sizeof(header), 1, intervals->out);
+    for (int i = 0; i < NUM_COLUMNS; ++i) {
+      fwrite(column_names[i], 1, strlen(column_names[i]) + 1, intervals->out);
+    }
+  }
+
+  cpu->intervals = intervals;
+  take_sample(cpu);
+  return 0;
+}
+
+/*
+ * Writes the row of the interval ending at the current cycle and starts
+ * the next one; an interval without cycles writes nothing
+ */
+void
+APEX_intervals_sample(APEX_CPU* cpu)
+{
+  APEX_Intervals* intervals = cpu->intervals;
+  if (!intervals) {
+    return;
+  }
+  const APEX_Counters* now = &cpu->counters;
+  const APEX_Counters* last = &intervals->last;
+  long long row[NUM_COLUMNS];
+  row[COL_CYCLE] = cpu->clock - 1;
+  row[COL_CYCLES] = row[COL_CYCLE] - intervals->last_cycle;
+  if (row[COL_CYCLES] <= 0) {
+    take_sample(cpu);
+    return;
+  }
+  row[COL_COMMITTED] = now->committed - last->committed;
+  row[COL_STALL_RAW] = now->stalls[STALL_RAW] - last->stalls[STALL_RAW];
+  row[COL_STALL_Z] = now->stalls[STALL_Z] - last->stalls[STALL_Z];
+  row[COL_FLUSH_BUBBLES] =
+    now->stalls[STALL_FLUSH] - last->stalls[STALL_FLUSH];
+  row[COL_BRANCHES] = mix(now, OP_BZ, OP_BNZ) - mix(last, OP_BZ, OP_BNZ) +
+                      now->mix[OP_JUMP] - last->mix[OP_JUMP];
+  row[COL_LOADS] = mix(now, OP_LOAD, OP_LDR) - mix(last, OP_LOAD, OP_LDR);
+  row[COL_STORES] = mix(now, OP_STORE, OP_STR) - mix(last, OP_STORE, OP_STR);
+
+  if (intervals->csv) {
+    for (int i = 0; i < NUM_COLUMNS; ++i) {
+      fprintf(intervals->out, "%s%lld", i ? "," : "", row[i]);
+      if (i == COL_COMMITTED) {
+        fprintf(intervals->out, ",%.4f",
+                (double)row[COL_COMMITTED] / row[COL_CYCLES]);
+      }
+    }
+    fprintf(intervals->out, "\n");
+  }
+  else {
+    fwrite(row, sizeof(row), 1, intervals->out);
+  }
+  take_sample(cpu);
+}
+
+/*
+ * Starts a new interval at the current cycle without writing a row, after
+ * a reset or restore has moved the clock and counters
+ */
+void
+APEX_intervals_restart(APEX_CPU* cpu)
+{
+  if (cpu->intervals) {
+    take_sample(cpu);
+  }
+}
+
+/*
+ * Writes the row of the unfinished interval and closes the file
+ *
+ * Returns 0 on success, -1 if the file could not be written
+ */
+int
+APEX_intervals_close(APEX_CPU* cpu)
+{
+  APEX_Intervals* intervals = cpu->intervals;
+  if (!intervals) {
+    return 0;
+  }
+  APEX_intervals_sample(cpu);
+  int ok = !ferror(intervals->out);
+  ok = fclose(intervals->out) == 0 && ok;
+  free(intervals);
+  cpu->intervals = NULL;
+  cpu->interval_next = LLONG_MAX;
+  return ok ? 0 : -1;
+}
@@ -11,6 +11,30 @@
 #include <limits.h>
 #include "cpu.h"
 
+/*
+ * Parses n counts separated by ':', as parse_count does, into counts.
+ *
+ * Returns 0 on success, -1 unless text holds exactly n counts of at most max
+ */
+static int
+parse_counts(const char* text, long long* counts, int n, long long max)
+{
+  char field[32];
+  for (int k = 0; k < n; ++k) {
+    const char* end = k < n - 1 ? strchr(text, ':') : text + strlen(text);
+    if (!end || end - text >= sizeof(field)) {
+      return -1;
+    }
+    memcpy(field, text, end - text);
+    field[end - text] = '\0';
+    if (parse_count(field, &counts[k]) != 0 || counts[k] > max) {
+      return -1;
+    }
+    text = end + 1;
+  }
+  return 0;
+}
+
 int
 main(int argc, char** argv)
 {
@@ -19,12 +43,9 @@ main(int argc, char** argv)
   //   exit(1);
   // }
 
-  APEX_CPU* cpu = APEX_cpu_init(argv[1]);
-  if (!cpu) {
-    fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
-    exit(1);
-  }
-  int cycle = INT_MAX;
+  APEX_Config config = { .trace = 1, .out = stdout, .err = stderr,
+                         .cycle_budget = LLONG_MAX };
+  long long cycle = LLONG_MAX;
   int mode = 0;
   if(strcmp(argv[2], "simulate") == 0){
     mode = 0;
@@ -32,15 +53,142 @@ main(int argc, char** argv)
   else if(strcmp(argv[2], "display") == 0){
     mode = 1;
   }
+  else if(strcmp(argv[2], "functional") == 0){
+    mode = 2;
+  }
+  else if(strcmp(argv[2], "threaded") == 0){
+    mode = 3;
+  }
+  else if(strcmp(argv[2], "block") == 0){
+    mode = 4;
+  }
+  else if(strcmp(argv[2], "sample") == 0){
+    mode = 5;
+  }
   else{
-    printf("for second parameter, please enter \"simulate\" or \"display\".\n");
+    printf("for second parameter, please enter \"simulate\", \"display\", \"functional\", \"threaded\", \"block\" or \"sample\".\n");
     return 0;
   }
-  if(argc >= 4){
-    cycle = atoi(argv[3]);
+  /* [cycle] [-r checkpoint to restore] [-c checkpoint to write at the end]
+   * [-s interval:warmup:length for sample mode]
+   * [-p seconds between progress lines] [-m words of data memory]
+   * [-d data memory image to preload] [-D data memory image to write]
+   * [-w first:last cycle to trace] [-a low:high PC to trace]
+   * [-t binary trace file] [-x counters file, .json or .csv]
+   * [-f to profile hot instructions and loops]
+   * [-i cycles:file for interval statistics, .csv or binary] */
+  const char* restore_file = NULL;
+  const char* data_file = NULL;
+  const char* checkpoint_file = NULL;
+  for (int i = 3; i < argc; ++i) {
+    long long words;
+    long long counts[3];
+    if(strcmp(argv[i], "-r") == 0 && i + 1 < argc){
+      restore_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+      checkpoint_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-s") == 0 && i + 1 < argc){
+      if (parse_counts(argv[++i], counts, 3, INT_MAX) != 0) {
+        fprintf(stderr, "APEX_Error : Invalid sample parameters %s, "
+                "expected interval:warmup:length\n", argv[i]);
+        exit(1);
+      }
+      config.sample_interval = counts[0];
+      config.sample_warmup = counts[1];
+      config.sample_length = counts[2];
+    }
+    else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc){
+      if (parse_counts(argv[++i], counts, 1, INT_MAX) != 0) {
+        fprintf(stderr, "APEX_Error : Invalid progress interval %s\n", argv[i]);
+        exit(1);
+      }
+      config.progress = counts[0];
+    }
+    else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc){
+      if (parse_count(argv[++i], &words) != 0 || words <= 0 || words > INT_MAX) {
+        fprintf(stderr, "APEX_Error : Invalid data memory size %s\n", argv[i]);
+        exit(1);
+      }
+      config.data_memory_size = words;
+    }
+    else if(strcmp(argv[i], "-d") == 0 && i + 1 < argc){
+      data_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-D") == 0 && i + 1 < argc){
+      config.data_dump = argv[++i];
+    }
+    else if(strcmp(argv[i], "-w") == 0 && i + 1 < argc){
+      if (parse_counts(argv[++i], counts, 2, LLONG_MAX) != 0 ||
+          (counts[1] > 0 && counts[0] > counts[1])) {
+        fprintf(stderr, "APEX_Error : Invalid trace window %s, "
+                "expected first:last\n", argv[i]);
+        exit(1);
+      }
+      config.trace_first = counts[0];
+      config.trace_last = counts[1];
+    }
+    else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc){
+      if (parse_counts(argv[++i], counts, 2, INT_MAX) != 0 ||
+          (counts[1] > 0 && counts[0] > counts[1])) {
+        fprintf(stderr, "APEX_Error : Invalid trace PC range %s, "
+                "expected low:high\n", argv[i]);
+        exit(1);
+      }
+      config.trace_pc_low = counts[0];
+      config.trace_pc_high = counts[1];
+    }
+    else if(strcmp(argv[i], "-t") == 0 && i + 1 < argc){
+      config.trace_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-x") == 0 && i + 1 < argc){
+      config.counters_file = argv[++i];
+    }
+    else if(strcmp(argv[i], "-f") == 0){
+      config.profile = 1;
+    }
+    else if(strcmp(argv[i], "-i") == 0 && i + 1 < argc){
+      char* file = strchr(argv[++i], ':');
+      if (file) {
+        *file++ = '\0';
+      }
+      if (!file || !*file || parse_count(argv[i], &config.interval) != 0 ||
+          config.interval <= 0) {
+        fprintf(stderr, "APEX_Error : Invalid interval statistics %s, "
+                "expected cycles:file\n", argv[i]);
+        exit(1);
+      }
+      config.interval_file = file;
+    }
+    else if(parse_count(argv[i], &cycle) != 0){
+      fprintf(stderr, "APEX_Error : Invalid cycle count %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  APEX_CPU* cpu = APEX_cpu_open(argv[1], &config);
+  if (!cpu) {
+    fprintf(stderr, "APEX_Error : Unable to initialize CPU\n");
+    exit(1);
   }
 
+  if (data_file && APEX_cpu_load_data(cpu, data_file) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to load data memory image %s\n", data_file);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
+  if (restore_file && APEX_cpu_restore(cpu, restore_file) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to restore checkpoint %s\n", restore_file);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
   APEX_cpu_run(cpu, mode, cycle);
+  if (checkpoint_file && APEX_cpu_save(cpu, checkpoint_file) != 0) {
+    fprintf(stderr, "APEX_Error : Unable to write checkpoint %s\n", checkpoint_file);
+    APEX_cpu_stop(cpu);
+    exit(1);
+  }
   APEX_cpu_stop(cpu);
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,268 @@
+/*
+ *  profile.c
+ *  Contains the per-PC pipeline profiler. With config.profile set, every
+ *  simulated cycle is charged to the instruction in each occupied latch;
+ *  decode stall cycles are charged to the instruction held in decode and
+ *  flush bubbles to the branch that caused them. The report ranks the
+ *  hottest instructions and loops, each shown with its .asm source line.
+ *
+ *  An instruction's cost is one issue cycle per commit, plus the cycles
+ *  it stalled in decode and the bubbles its taken branches caused, so the
+ *  costs of all instructions add up to the cycles of the run less the
+ *  pipeline fill. Squashed wrong-path instructions cost nothing of their
+ *  own; their slots are the branch's flush bubbles.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+#define HOT_INSTRUCTIONS 10
+#define HOT_LOOPS 5
+
+static APEX_Profile_Entry*
+profile_entry(const APEX_CPU* cpu, int pc)
+{
+  unsigned int index = (unsigned int)(pc - 4000) / 4;
+  if (pc < 4000 || index >= (unsigned int)cpu->profile_size) {
+    return NULL;
+  }
+  return &cpu->profile[index];
+}
+
+/*
+ * Allocates the profile of the attached program, if config.profile asks
+ * for one and it does not exist yet.
+ *
+ * Returns 0 on success, -1 if it could not be allocated
+ */
+int
+APEX_profile_start(APEX_CPU* cpu)
+{
+  if (cpu->profile || !cpu->program) {
+    return 0;
+  }
+  int size = cpu->program->code_memory_size;
+  cpu->profile = calloc(size, sizeof(*cpu->profile));
+  if (!cpu->profile) {
+    return -1;
+  }
+  cpu->profile_size = size;
+  return 0;
+}
+
+void
+APEX_profile_free(APEX_CPU* cpu)
+{
+  free(cpu->profile);
+  cpu->profile = NULL;
+  cpu->profile_size = 0;
+}
+
+/*
+ * Charges cycles cycles to the instruction in every occupied latch, and
+ * to the instruction in decode if decode stalled
+ */
+void
+APEX_profile_cycles(APEX_CPU* cpu, long long cycles)
+{
+  for (int i = F; i < NUM_STAGES; ++i) {
+    APEX_Profile_Entry* entry;
+    if (cpu->stage[i].op != OP_NONE &&
+        (entry = profile_entry(cpu, cpu->stage[i].pc))) {
+      entry->stage_cycles[i] += cycles;
+    }
+  }
+  if (cpu->stall_cause == STALL_RAW || cpu->stall_cause == STALL_Z) {
+    APEX_Profile_Entry* entry = profile_entry(cpu, cpu->stage[DRF].pc);
+    if (entry) {
+      entry->stall_cycles += cycles;
+    }
+  }
+}
+
+/* Records a taken branch that squashed bubbles wrong-path instructions */
+void
+APEX_profile_branch(APEX_CPU* cpu, const CPU_Stage* branch, int bubbles)
+{
+  APEX_Profile_Entry* entry = profile_entry(cpu, branch->pc);
+  if (entry) {
+    entry->taken++;
+    entry->flush_bubbles += bubbles;
+    entry->target = branch->op == OP_JUMP ? branch->buffer
+                                          : branch->pc + branch->imm;
+  }
+}
+
+void
+APEX_profile_commit(APEX_CPU* cpu, const CPU_Stage* stage)
+{
+  APEX_Profile_Entry* entry = profile_entry(cpu, stage->pc);
+  if (entry) {
+    entry->committed++;
+  }
+}
+
+/* Latch-cycles the instruction spent anywhere in the pipeline */
+static long long
+resident(const APEX_Profile_Entry* entry)
+{
+  long long cycles = 0;
+  for (int i = F; i < NUM_STAGES; ++i) {
+    cycles += entry->stage_cycles[i];
+  }
+  return cycles;
+}
+
+static long long
+cost(const APEX_Profile_Entry* entry)
+{
+  return entry->committed + entry->stall_cycles + entry->flush_bubbles;
+}
+
+/* Hot loop: the instructions from a backward branch's target up to it */
+typedef struct Hot_Loop
+{
+  int first;	    // Index of the first and last instruction
+  int last;
+  long long iterations;
+  long long cycles;
+} Hot_Loop;
+
+/* Instruction index and its cost, sorted for the hot-instruction table */
+typedef struct Hot_Instruction
+{
+  int index;
+  long long cost;
+} Hot_Instruction;
+
+static int
+compare_cost(const void* a, const void* b)
+{
+  const Hot_Instruction* ha = a;
+  const Hot_Instruction* hb = b;
+  if (ha->cost != hb->cost) {
+    return ha->cost < hb->cost ? 1 : -1;
+  }
+  return ha->index - hb->index;
+}
+
+static int
+compare_loops(const void* a, const void* b)
+{
+  long long ca = ((const Hot_Loop*)a)->cycles;
+  long long cb = ((const Hot_Loop*)b)->cycles;
+  return ca < cb ? 1 : ca > cb ? -1 : 0;
+}
+
+/* Source text of instruction i, or its mnemonic if there is no source */
+static const char*
+source_text(const APEX_CPU* cpu, char** texts, int found, int i)
+{
+  if (i < found) {
+    return texts[i];
+  }
+  return get_opcode_name(cpu->program->code_memory[i].op);
+}
+
+/*
+ * Prints the hot-instruction and hot-loop report of the profile
+ */
+void
+APEX_cpu_print_profile(const APEX_CPU* cpu, FILE* out)
+{
+  int size = cpu->profile_size;
+  const APEX_Profile_Entry* profile = cpu->profile;
+  if (!profile || size == 0) {
+    return;
+  }
+
+  int* lines = calloc(size, sizeof(int));
+  char** texts = calloc(size, sizeof(char*));
+  Hot_Instruction* order = malloc(sizeof(Hot_Instruction) * size);
+  Hot_Loop* loops = malloc(sizeof(Hot_Loop) * size);
+  if (!lines || !texts || !order || !loops) {
+    free(lines);
+    free(texts);
+    free(order);
+    free(loops);
+    return;
+  }
+  int found = 0;
+  if (cpu->program->source) {
+    found = read_source_lines(cpu->program->source, size, lines, texts);
+  }
+
+  long long total = 0;
+  for (int i = 0; i < size; ++i) {
+    order[i].index = i;
+    order[i].cost = cost(&profile[i]);
+    total += order[i].cost;
+  }
+  if (total == 0) {
+    total = 1;
+  }
+
+  qsort(order, size, sizeof(Hot_Instruction), compare_cost);
+  fprintf(out, "=============== HOT INSTRUCTIONS ===============\n");
+  fprintf(out, "%6s %6s %12s %12s %12s %12s %12s %6s  %s\n", "pc", "line",
+          "committed", "cycles", "stalls", "flushes", "resident", "%",
+          "source");
+  for (int k = 0; k < size && k < HOT_INSTRUCTIONS; ++k) {
+    int i = order[k].index;
+    const APEX_Profile_Entry* entry = &profile[i];
+    if (cost(entry) == 0) {
+      break;
+    }
+    fprintf(out, "%6d %6d %12lld %12lld %12lld %12lld %12lld %6.2f  %s\n",
+            4000 + 4 * i, i < found ? lines[i] : 0, entry->committed,
+            cost(entry), entry->stall_cycles, entry->flush_bubbles,
+            resident(entry), 100.0 * cost(entry) / total,
+            source_text(cpu, texts, found, i));
+  }
+
+  int num_loops = 0;
+  for (int i = 0; i < size; ++i) {
+    const APEX_Profile_Entry* entry = &profile[i];
+    int first = (entry->target - 4000) / 4;
+    if (entry->taken == 0 || entry->target < 4000 || first > i) {
+      continue;
+    }
+    Hot_Loop* loop = &loops[num_loops++];
+    loop->first = first;
+    loop->last = i;
+    loop->iterations = entry->taken;
+    loop->cycles = 0;
+    for (int j = first; j <= i; ++j) {
+      loop->cycles += cost(&profile[j]);
+    }
+  }
+  qsort(loops, num_loops, sizeof(Hot_Loop), compare_loops);
+  fprintf(out, "=============== HOT LOOPS ===============\n");
+  fprintf(out, "%6s %6s %13s %12s %12s %10s %6s\n", "from", "to", "lines",
+          "iterations", "cycles", "per iter", "%");
+  for (int k = 0; k < num_loops && k < HOT_LOOPS; ++k) {
+    const Hot_Loop* loop = &loops[k];
+    char range[32];
+    snprintf(range, sizeof(range), "%d-%d",
+             loop->first < found ? lines[loop->first] : 0,
+             loop->last < found ? lines[loop->last] : 0);
+    fprintf(out, "%6d %6d %13s %12lld %12lld %10.2f %6.2f\n",
+            4000 + 4 * loop->first, 4000 + 4 * loop->last, range,
+            loop->iterations, loop->cycles,
+            (double)loop->cycles / loop->iterations,
+            100.0 * loop->cycles / total);
+    for (int j = loop->first; j <= loop->last; ++j) {
+      fprintf(out, "%20s %s\n", "", source_text(cpu, texts, found, j));
+    }
+  }
+
+  for (int i = 0; i < found; ++i) {
+    free(texts[i]);
+  }
+  free(lines);
+  free(texts);
+  free(order);
+  free(loops);
+}
@@ -0,0 +1,79 @@
+/*
+ *  program.c
+ *  Contains the shared program object: code memory parsed (or mapped)
+ *  once and then attached read-only to any number of CPUs, on any
+ *  number of threads. The last release frees it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+
+/*
+ * Loads a text .asm file or a binary image written by apex-asm. Parse
+ * errors are reported on err, unless it is NULL.
+ *
+ * Returns the program holding one reference, or NULL if the file could
+ * not be loaded
+ */
+APEX_Program*
+APEX_program_load(const char* filename, FILE* err)
+{
+  if (!filename) {
+    return NULL;
+  }
+
+  APEX_Program* program = malloc(sizeof(*program));
+  if (!program) {
+    return NULL;
+  }
+  program->code_image = NULL;
+  program->code_image_len = 0;
+  program->source = NULL;
+  if (is_code_image(filename)) {
+    program->code_memory =
+      map_code_image(filename, &program->code_memory_size,
+                     &program->code_image, &program->code_image_len);
+  }
+  else {
+    program->code_memory =
+      create_code_memory(filename, &program->code_memory_size, err);
+    program->source = strdup(filename);
+  }
+  if (!program->code_memory) {
+    free(program->source);
+    free(program);
+    return NULL;
+  }
+  program->refs = 1;
+  return program;
+}
+
+APEX_Program*
+APEX_program_retain(APEX_Program* program)
+{
+  __atomic_add_fetch(&program->refs, 1, __ATOMIC_RELAXED);
+  return program;
+}
+
+/*
+ * Drops one reference, freeing the program with the last one
+ */
+void
+APEX_program_release(APEX_Program* program)
+{
+  if (!program ||
+      __atomic_sub_fetch(&program->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+  if (program->code_image) {
+    munmap(program->code_image, program->code_image_len);
+  }
+  else {
+    free(program->code_memory);
+  }
+  free(program->source);
+  free(program);
+}
@@ -0,0 +1,159 @@
+/*
+ *  program_image.c
+ *  Contains the pre-assembled binary program image: a small versioned
+ *  header followed by code memory exactly as the simulator holds it, so
+ *  that loading is a single mmap with no parsing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+
+#define APEX_IMAGE_MAGIC "APEX"
+#define APEX_IMAGE_VERSION 2
+
+/* Header at the start of every image file */
+typedef struct APEX_Image_Header
+{
+  char magic[4];	        // "APEX"
+  unsigned int version;	    // APEX_IMAGE_VERSION
+  unsigned int ins_size;	// sizeof(APEX_Instruction) of the writer
+  unsigned int count;	    // Instructions
+  unsigned int checksum;	// FNV-1a over all instruction bytes
+  unsigned int reserved;
+} APEX_Image_Header;
+
+/*
+ * FNV-1a hash of len bytes, used to validate files written by the
+ * simulator
+ */
+unsigned int
+apex_checksum(const void* data, size_t len)
+{
+  return apex_checksum_update(2166136261u, data, len);
+}
+
+/*
+ * Continues an apex_checksum over len more bytes
+ */
+unsigned int
+apex_checksum_update(unsigned int hash, const void* data, size_t len)
+{
+  const unsigned char* p = data;
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ p[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * Returns 1 if filename starts with the image magic
+ */
+int
+is_code_image(const char* filename)
+{
+  char magic[4];
+  FILE* fp = fopen(filename, "rb");
+  if (!fp) {
+    return 0;
+  }
+  int found = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+              memcmp(magic, APEX_IMAGE_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return found;
+}
+
+/*
+ * Writes size instructions of code memory as an image file.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+write_code_image(const char* filename, const APEX_Instruction* code, int size)
+{
+  size_t len = sizeof(*code) * size;
+  APEX_Image_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, APEX_IMAGE_MAGIC, sizeof(header.magic));
+  header.version = APEX_IMAGE_VERSION;
+  header.ins_size = sizeof(*code);
+  header.count = size;
+  header.checksum = apex_checksum(code, len);
+
+  FILE* fp = fopen(filename, "wb");
+  if (!fp) {
+    return -1;
+  }
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(code, len, 1, fp) == 1;
+  if (fclose(fp) != 0) {
+    ok = 0;
+  }
+  return ok ? 0 : -1;
+}
+
+/*
+ * Returns 1 if every instruction has a known opcode and register fields
+ * the register file holds; the engines index tables with them unchecked
+ */
+static int
+valid_code(const APEX_Instruction* code, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i) {
+    const APEX_Instruction* ins = &code[i];
+    if (ins->op >= NUM_OPCODES || ins->rd > 31 || ins->rs1 > 31 ||
+        ins->rs2 > 31 || ins->rs3 > 31) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Maps an image file read-only and returns its code memory. *mapping and
+ * *mapping_len receive what must later be passed to munmap.
+ *
+ * Returns NULL if the file is not a valid image of this version
+ */
+APEX_Instruction*
+map_code_image(const char* filename, int* size, void** mapping,
+               size_t* mapping_len)
+{
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < sizeof(APEX_Image_Header)) {
+    close(fd);
+    return NULL;
+  }
+  void* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    return NULL;
+  }
+
+  const APEX_Image_Header* header = base;
+  APEX_Instruction* code = (APEX_Instruction*)(header + 1);
+  size_t len = sizeof(*code) * (size_t)header->count;
+  if (memcmp(header->magic, APEX_IMAGE_MAGIC, sizeof(header->magic)) != 0 ||
+      header->version != APEX_IMAGE_VERSION ||
+      header->ins_size != sizeof(*code) || header->count == 0 ||
+      st.st_size != sizeof(*header) + len ||
+      header->checksum != apex_checksum(code, len) ||
+      !valid_code(code, header->count)) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+
+  *size = header->count;
+  *mapping = base;
+  *mapping_len = st.st_size;
+  return code;
+}
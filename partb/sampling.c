@@ -0,0 +1,140 @@
+/*
+ *  sampling.c
+ *  Contains the sampled simulation mode. The program is executed by the
+ *  block engine, which holds the architectural state throughout; every
+ *  sample_interval instructions, a scratch CPU is loaded with that state
+ *  and run through the 7-stage pipeline, first for sample_warmup
+ *  committed instructions to fill the latches and scoreboard, then for
+ *  sample_length measured cycles. The per-sample CPIs give the estimate
+ *  and its confidence interval.
+ *
+ *  Detailed windows only measure: what they compute is discarded, so
+ *  sampling never changes the architectural result of a run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "cpu.h"
+
+#define DEFAULT_SAMPLE_INTERVAL 100000
+#define DEFAULT_SAMPLE_WARMUP 100
+#define DEFAULT_SAMPLE_LENGTH 1000
+
+/* Worst case cycles per instruction while warming up; a pipeline that
+ * commits nothing for this long is deadlocked */
+#define MAX_WARMUP_CPI 16
+
+/*
+ * Runs one detailed window on detail, starting from the architectural
+ * state of cpu.
+ *
+ * Commits are counted by counters.committed, which only writeback
+ * advances; ins_completed is overwritten when decode sees HALT.
+ *
+ * Returns 1 and the window's CPI in *cpi, or 0 if the window committed
+ * nothing, reached the end of the program or could not copy memory
+ */
+static int
+measure_window(APEX_CPU* detail, const APEX_CPU* cpu, int warmup, int length,
+               double* cpi)
+{
+  APEX_cpu_reset(detail);
+  detail->pc = cpu->pc;
+  memcpy(detail->regs, cpu->regs, sizeof(detail->regs));
+  /* The functional engines do not track which registers were written */
+  detail->regs_written = ~0u;
+  if (copy_data_memory(detail, cpu) != 0) {
+    return 0;
+  }
+  detail->z = cpu->z;
+  detail->z_valid = cpu->z_valid;
+
+  int warmup_cycles = MAX_WARMUP_CPI * (warmup + 1);
+  while (detail->counters.committed < warmup && warmup_cycles-- > 0 &&
+         !APEX_cpu_finished(detail)) {
+    APEX_cpu_step(detail, 1);
+  }
+
+  long long start_clock = detail->clock;
+  long long start_ins = detail->counters.committed;
+  APEX_cpu_step(detail, length);
+  long long cycles = detail->clock - start_clock;
+  long long committed = detail->counters.committed - start_ins;
+  if (committed <= 0 || APEX_cpu_finished(detail)) {
+    return 0;
+  }
+  *cpi = (double)cycles / committed;
+  return 1;
+}
+
+/*
+ * Executes up to count instructions like APEX_functional_run, taking a
+ * detailed pipeline sample every config.sample_interval instructions.
+ * A zero sampling parameter selects its default.
+ *
+ * Returns the number of instructions executed
+ */
+long long
+APEX_sample_run(APEX_CPU* cpu, long long count, APEX_Sample_Result* result)
+{
+  int interval = cpu->config.sample_interval > 0 ? cpu->config.sample_interval
+                                                 : DEFAULT_SAMPLE_INTERVAL;
+  int warmup = cpu->config.sample_warmup > 0 ? cpu->config.sample_warmup
+                                             : DEFAULT_SAMPLE_WARMUP;
+  int length = cpu->config.sample_length > 0 ? cpu->config.sample_length
+                                             : DEFAULT_SAMPLE_LENGTH;
+
+  memset(result, 0, sizeof(*result));
+
+  APEX_Config config = cpu->config;
+  config.trace = 0;
+  config.cycle_budget = LLONG_MAX;
+  config.progress = 0;
+  config.interval = 0;
+  APEX_CPU* detail = APEX_cpu_create(&config);
+  if (!detail) {
+    return APEX_block_run(cpu, count);
+  }
+  APEX_cpu_attach(detail, cpu->program);
+
+  double sum = 0;
+  double sum_squares = 0;
+  long long executed = 0;
+  while (executed < count && !APEX_cpu_finished(cpu)) {
+    /* A window starting on BZ/BNZ would resolve it from the retired Z
+     * flag, a path that branches from the fetch PC and that the running
+     * program need not take; start it one instruction later */
+    int index = get_code_index(cpu->pc);
+    if (index >= 0 && index < cpu->program->code_memory_size &&
+        (cpu->code_memory[index].op == OP_BZ ||
+         cpu->code_memory[index].op == OP_BNZ)) {
+      executed += APEX_functional_run(cpu, 1);
+      if (executed >= count || APEX_cpu_finished(cpu)) {
+        break;
+      }
+    }
+    double cpi;
+    if (measure_window(detail, cpu, warmup, length, &cpi)) {
+      result->samples++;
+      sum += cpi;
+      sum_squares += cpi * cpi;
+    }
+    long long step = count - executed < interval ? count - executed : interval;
+    executed += APEX_block_run(cpu, step);
+  }
+  APEX_cpu_stop(detail);
+
+  result->instructions = executed;
+  if (result->samples > 0) {
+    int n = result->samples;
+    result->cpi = sum / n;
+    if (n > 1) {
+      double variance = (sum_squares - sum * sum / n) / (n - 1);
+      result->cpi_error = 1.96 * sqrt(variance > 0 ? variance : 0) / sqrt(n);
+    }
+  }
+  return executed;
+}
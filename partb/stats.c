@@ -0,0 +1,126 @@
+/*
+ *  stats.c
+ *  Contains the performance counter report: cycles, committed
+ *  instructions, CPI, decode stalls by cause, forwarding by source latch
+ *  and the instruction mix. The counters are listed once, as named
+ *  values, and printed as a table or exported as JSON or CSV from that
+ *  list.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+
+/* Counter names in report order, with room for the instruction mix */
+#define MAX_COUNTERS (16 + NUM_OPCODES)
+
+typedef struct Counter
+{
+  char name[24];
+  long long value;
+} Counter;
+
+static int
+add_counter(Counter* list, int n, const char* prefix, const char* name,
+            long long value)
+{
+  snprintf(list[n].name, sizeof(list[n].name), "%s%s", prefix, name);
+  list[n].value = value;
+  return n + 1;
+}
+
+/* Fills list with the counters of cpu, returning how many there are */
+static int
+list_counters(const APEX_CPU* cpu, Counter* list)
+{
+  const APEX_Counters* counters = &cpu->counters;
+  int n = 0;
+  n = add_counter(list, n, "", "cycles", cpu->clock - 1);
+  n = add_counter(list, n, "", "committed", counters->committed);
+  n = add_counter(list, n, "stall_", "raw", counters->stalls[STALL_RAW]);
+  n = add_counter(list, n, "stall_", "z", counters->stalls[STALL_Z]);
+  n = add_counter(list, n, "", "flush_bubbles",
+                  counters->stalls[STALL_FLUSH]);
+  n = add_counter(list, n, "forward_", "mem1", counters->forwards[MEM1]);
+  n = add_counter(list, n, "forward_", "mem2", counters->forwards[MEM2]);
+  n = add_counter(list, n, "forward_", "wb", counters->forwards[WB]);
+  n = add_counter(list, n, "", "regfile_reads", counters->forwards[0]);
+  n = add_counter(list, n, "z_forward_", "mem1", counters->z_forwards[MEM1]);
+  n = add_counter(list, n, "z_forward_", "mem2", counters->z_forwards[MEM2]);
+  for (int op = OP_MOVC; op < OP_UNKNOWN; ++op) {
+    n = add_counter(list, n, "mix_", get_opcode_name(op), counters->mix[op]);
+  }
+  return n;
+}
+
+static double
+cpi(const APEX_CPU* cpu)
+{
+  long long committed = cpu->counters.committed;
+  return committed > 0 ? (double)(cpu->clock - 1) / committed : 0;
+}
+
+void
+APEX_cpu_print_counters(const APEX_CPU* cpu, FILE* out)
+{
+  Counter list[MAX_COUNTERS];
+  int n = list_counters(cpu, list);
+  fprintf(out, "=============== PERFORMANCE COUNTERS ===============\n");
+  for (int i = 0; i < n; ++i) {
+    if (strncmp(list[i].name, "mix_", 4) == 0 && list[i].value == 0) {
+      continue;
+    }
+    fprintf(out, "|     %-16s|     %12lld     |\n", list[i].name, list[i].value);
+    if (i == 1) {
+      fprintf(out, "|     %-16s|     %12.4f     |\n", "cpi", cpi(cpu));
+    }
+  }
+}
+
+/*
+ * Writes the counters to filename, as one JSON object if its name ends in
+ * ".json" and otherwise as CSV: a header row and a row of values.
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int
+APEX_cpu_write_counters(const APEX_CPU* cpu, const char* filename)
+{
+  Counter list[MAX_COUNTERS];
+  int n = list_counters(cpu, list);
+  const char* ext = strrchr(filename, '.');
+  int json = ext && strcmp(ext, ".json") == 0;
+
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    return -1;
+  }
+  if (json) {
+    fprintf(fp, "{");
+    for (int i = 0; i < n; ++i) {
+      fprintf(fp, "%s\n  \"%s\": %lld", i ? "," : "", list[i].name,
+              list[i].value);
+      if (i == 1) {
+        fprintf(fp, ",\n  \"cpi\": %.6f", cpi(cpu));
+      }
+    }
+    fprintf(fp, "\n}\n");
+  }
+  else {
+    for (int i = 0; i < n; ++i) {
+      fprintf(fp, "%s%s", i ? "," : "", list[i].name);
+      if (i == 1) {
+        fprintf(fp, ",cpi");
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      fprintf(fp, "%s%lld", i ? "," : "\n", list[i].value);
+      if (i == 1) {
+        fprintf(fp, ",%.6f", cpi(cpu));
+      }
+    }
+    fprintf(fp, "\n");
+  }
+  return fclose(fp) == 0 ? 0 : -1;
+}
@@ -0,0 +1,5 @@
+MOVC,R1,#2000
+MOVC,R2,#0
+ADDL,R2,R2,#3
+SUBL,R1,R1,#1
+BNZ,#-8
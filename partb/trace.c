@@ -0,0 +1,747 @@
+/*
+ *  trace.c
+ *  Contains the asynchronous pipeline trace of display mode. Each traced
+ *  cycle, the simulator only copies the fields a trace shows of every
+ *  stage latch, as it stands when the stage prints it, into a record in
+ *  a per-CPU ring buffer; a background writer thread formats the records
+ *  and writes them out.
+ *  Records are handed to the writer in batches, so the simulator takes
+ *  the lock once every TRACE_BATCH cycles and only waits when the ring is
+ *  full.
+ *
+ *  Output is identical to printing each stage directly, but appears late:
+ *  APEX_trace_flush waits until everything recorded has been written.
+ *
+ *  With config.trace_file set, the writer stores a compact binary trace
+ *  there instead, which apex_tracedump turns back into text or CSV. The
+ *  file is the magic "APXT" and a 32-bit version, followed by one entry
+ *  per traced cycle:
+ *
+ *    varint      cycles since the previous entry
+ *    2 bytes     2 bits per stage, F first: LATCH_SAME, LATCH_ADVANCED,
+ *                LATCH_NEW or LATCH_HIDDEN
+ *    per stage marked LATCH_NEW, in stage order:
+ *      byte      flags (bit 0 busy, bit 1 stalled)
+ *      varint    pc - 4000, zigzag encoded
+ *      4 bytes   opcode ID, rd, rs1, rs2
+ *      varint    imm, zigzag encoded
+ *
+ *  Varints hold 7 bits per byte, low bits first. Only the fields that the
+ *  text trace shows are recorded. A latch holding a PC outside the traced
+ *  range is LATCH_HIDDEN and decodes with PC -1, which no trace shows;
+ *  cycles with every latch hidden get no entry.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "cpu.h"
+
+#define TRACE_RECORDS 8192
+#define TRACE_BATCH 2048
+#define TRACE_TEXT_SIZE (1 << 20)
+#define TRACE_LINES 256
+
+/* Upper bound on the text of one record: three header lines and seven
+ * stage lines of under 100 characters each */
+#define MAX_RECORD_TEXT 1024
+
+#define APEX_TRACE_MAGIC "APXT"
+#define APEX_TRACE_VERSION 2
+
+/* How a latch in a binary trace entry relates to the previous entry */
+enum
+{
+  LATCH_SAME,	    // Unchanged
+  LATCH_ADVANCED,	// Holds what the stage before it held
+  LATCH_NEW,	    // Stored in full
+  LATCH_HIDDEN,	    // Outside the traced PC range
+};
+
+/* Fields of a stage latch that a trace shows. Every byte is written, so
+ * latches compare with memcmp. */
+typedef struct Trace_Latch
+{
+  int pc;
+  int imm;
+  unsigned char op;
+  unsigned char rd;
+  unsigned char rs1;
+  unsigned char rs2;
+  unsigned char busy;
+  unsigned char stalled;
+  unsigned short unused;	// Always 0
+} Trace_Latch;
+
+/* One traced cycle */
+typedef struct APEX_Trace_Record
+{
+  long long clock;
+  Trace_Latch stage[NUM_STAGES];	// Each latch as its stage printed it
+} APEX_Trace_Record;
+
+/* Stage line formatted for a latch; busy and stalled are not printed */
+typedef struct Trace_Line
+{
+  int valid;
+  int len;
+  Trace_Latch latch;
+  char text[96];
+} Trace_Line;
+
+/* Text formatted by the writer, written out in blocks of up to
+ * TRACE_TEXT_SIZE bytes. The same few instructions fill the latches
+ * cycle after cycle, so stage lines are kept by PC and copied rather
+ * than formatted again. */
+typedef struct Trace_Text
+{
+  FILE* out;
+  size_t len;
+  char buf[TRACE_TEXT_SIZE];
+  Trace_Line lines[NUM_STAGES][TRACE_LINES];
+} Trace_Text;
+
+typedef struct APEX_Trace
+{
+  APEX_Trace_Record records[TRACE_RECORDS];
+
+  Trace_Text text;
+  int binary;	    // Write a binary trace rather than text
+  int pc_low;	    // Stage lines outside this PC range are left out
+  int pc_high;
+
+  /* Binary encoder state: the previous entry */
+  long long last_clock;
+  Trace_Latch last_latch[NUM_STAGES];
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;	    // Signalled whenever published or tail moves
+
+  long long head;	        // Records filled, owned by the simulator
+  long long published;	    // Records handed to the writer, under lock
+  long long tail;	        // Records written out, under lock
+  long long tail_seen;	    // Simulator's last view of tail
+  int stop;
+} APEX_Trace;
+
+/* Stage names as printed, indexed by stage; stages print from WB down */
+static const char* const stage_names[NUM_STAGES] = {
+  [F] = "Fetch",
+  [DRF] = "Decode/RF",
+  [EX1] = "Execute1",
+  [EX2] = "Execute2",
+  [MEM1] = "Memory1",
+  [MEM2] = "Memory2",
+  [WB] = "Writeback",
+};
+
+static void
+put_str(Trace_Text* text, const char* str)
+{
+  size_t len = strlen(str);
+  memcpy(text->buf + text->len, str, len);
+  text->len += len;
+}
+
+/* Appends str left-justified in width columns, like "%-*s" */
+static void
+put_padded(Trace_Text* text, const char* str, int width)
+{
+  size_t len = strlen(str);
+  memcpy(text->buf + text->len, str, len);
+  if ((int)len < width) {
+    memset(text->buf + text->len + len, ' ', width - len);
+    len = width;
+  }
+  text->len += len;
+}
+
+static void
+put_int(Trace_Text* text, long long value)
+{
+  char digits[24];
+  int n = 0;
+  unsigned long long v = value < 0 ? -(unsigned long long)value : value;
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (value < 0) {
+    text->buf[text->len++] = '-';
+  }
+  while (n > 0) {
+    text->buf[text->len++] = digits[--n];
+  }
+}
+
+static void
+put_reg(Trace_Text* text, const char* prefix, int reg)
+{
+  put_str(text, prefix);
+  put_int(text, reg);
+}
+
+static void
+print_instruction(Trace_Text* text, const Trace_Latch* stage)
+{
+  put_str(text, get_opcode_name(stage->op));
+
+  switch (stage->op) {
+    case OP_HALT:
+      put_str(text, " ");
+      break;
+
+    case OP_STORE:
+      put_reg(text, ",R", stage->rs1);
+      put_reg(text, ",R", stage->rs2);
+      put_reg(text, ",#", stage->imm);
+      put_str(text, " ");
+      break;
+
+    case OP_MOVC:
+      put_reg(text, ",R", stage->rd);
+      put_reg(text, ",#", stage->imm);
+      put_str(text, " ");
+      break;
+
+    case OP_LOAD:
+    case OP_ADDL:
+    case OP_SUBL:
+      put_reg(text, ",R", stage->rd);
+      put_reg(text, ",R", stage->rs1);
+      put_reg(text, ",#", stage->imm);
+      put_str(text, " ");
+      break;
+
+    case OP_STR:
+    case OP_LDR:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_AND:
+    case OP_OR:
+    case OP_EXOR:
+    case OP_MUL:
+      put_reg(text, ",R", stage->rd);
+      put_reg(text, ",R", stage->rs1);
+      put_reg(text, ",R", stage->rs2);
+      put_str(text, " ");
+      break;
+
+    case OP_BZ:
+    case OP_BNZ:
+      put_reg(text, ",#", stage->imm);
+      put_str(text, " ");
+      break;
+
+    case OP_JUMP:
+      put_reg(text, ",R", stage->rs1);
+      put_reg(text, ",#", stage->imm);
+      break;
+  }
+}
+
+/* Debug function which dumps the cpu stage
+ * content
+ */
+static void
+print_stage_content(Trace_Text* text, int index, const Trace_Latch* stage)
+{
+  Trace_Line* line =
+    &text->lines[index][(unsigned int)stage->pc / 4 % TRACE_LINES];
+  if (line->valid && line->latch.pc == stage->pc &&
+      line->latch.imm == stage->imm && line->latch.op == stage->op &&
+      line->latch.rd == stage->rd && line->latch.rs1 == stage->rs1 &&
+      line->latch.rs2 == stage->rs2) {
+    memcpy(text->buf + text->len, line->text, line->len);
+    text->len += line->len;
+    return;
+  }
+
+  size_t start = text->len;
+  put_padded(text, stage_names[index], 15);
+  put_reg(text, ": pc(", stage->pc);
+  put_str(text, ") ");
+  print_instruction(text, stage);
+  put_str(text, "\n");
+  line->valid = 1;
+  line->latch = *stage;
+  line->len = text->len - start;
+  memcpy(line->text, text->buf + start, line->len);
+}
+
+static int
+in_pc_range(int pc, int pc_low, int pc_high)
+{
+  return pc >= pc_low && pc <= pc_high;
+}
+
+/* Makes text room for one more record, writing out what it holds */
+static void
+reserve_text(Trace_Text* text)
+{
+  if (text->len > TRACE_TEXT_SIZE - MAX_RECORD_TEXT) {
+    fwrite(text->buf, 1, text->len, text->out);
+    text->len = 0;
+  }
+}
+
+static void
+print_record(Trace_Text* text, const APEX_Trace_Record* record, int pc_low,
+             int pc_high)
+{
+  int stage;
+  for (stage = WB; stage >= F; --stage) {
+    if (in_pc_range(record->stage[stage].pc, pc_low, pc_high)) {
+      break;
+    }
+  }
+  if (stage < F) {
+    return;
+  }
+
+  reserve_text(text);
+  put_str(text, "--------------------------------\n");
+  put_reg(text, "Clock Cycle #: ", record->clock);
+  put_str(text, "\n--------------------------------\n");
+  for (stage = WB; stage >= F; --stage) {
+    if (in_pc_range(record->stage[stage].pc, pc_low, pc_high)) {
+      print_stage_content(text, stage, &record->stage[stage]);
+    }
+  }
+}
+
+/* Prints the latches of record that a trace shows as CSV rows, F first */
+static void
+print_record_csv(Trace_Text* text, const APEX_Trace_Record* record)
+{
+  reserve_text(text);
+  for (int stage = F; stage < NUM_STAGES; ++stage) {
+    const Trace_Latch* latch = &record->stage[stage];
+    if (!in_pc_range(latch->pc, 0, INT_MAX)) {
+      continue;
+    }
+    put_int(text, record->clock);
+    put_str(text, ",");
+    put_str(text, stage_names[stage]);
+    put_reg(text, ",", latch->pc);
+    put_str(text, ",");
+    put_str(text, get_opcode_name(latch->op));
+    put_reg(text, ",", latch->rd);
+    put_reg(text, ",", latch->rs1);
+    put_reg(text, ",", latch->rs2);
+    put_reg(text, ",", latch->imm);
+    put_reg(text, ",", latch->busy);
+    put_reg(text, ",", latch->stalled);
+    put_str(text, "\n");
+  }
+}
+
+static void
+put_varint(Trace_Text* text, unsigned long long value)
+{
+  while (value >= 0x80) {
+    text->buf[text->len++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  text->buf[text->len++] = value;
+}
+
+static unsigned long long
+zigzag(long long value)
+{
+  return ((unsigned long long)value << 1) ^ (value < 0 ? ~0ULL : 0);
+}
+
+static long long
+unzigzag(unsigned long long value)
+{
+  return (long long)(value >> 1) ^ -(long long)(value & 1);
+}
+
+/* Latch a trace stores for a stage outside the traced PC range */
+static void
+hidden_latch(Trace_Latch* latch)
+{
+  memset(latch, 0, sizeof(*latch));
+  latch->pc = -1;
+}
+
+static void
+encode_record(APEX_Trace* trace, Trace_Text* text,
+              const APEX_Trace_Record* record)
+{
+  Trace_Latch latch[NUM_STAGES];
+  unsigned int codes = 0;
+  int shown = 0;
+  for (int stage = F; stage < NUM_STAGES; ++stage) {
+    int code = LATCH_NEW;
+    if (in_pc_range(record->stage[stage].pc, trace->pc_low, trace->pc_high)) {
+      latch[stage] = record->stage[stage];
+      shown = 1;
+    }
+    else {
+      hidden_latch(&latch[stage]);
+      code = LATCH_HIDDEN;
+    }
+    if (memcmp(&latch[stage], &trace->last_latch[stage],
+               sizeof(Trace_Latch)) == 0) {
+      code = LATCH_SAME;
+    }
+    else if (stage > F && memcmp(&latch[stage], &trace->last_latch[stage - 1],
+                                 sizeof(Trace_Latch)) == 0) {
+      code = LATCH_ADVANCED;
+    }
+    codes |= code << (2 * stage);
+  }
+  if (!shown) {
+    return;
+  }
+
+  reserve_text(text);
+  put_varint(text, record->clock - trace->last_clock);
+  text->buf[text->len++] = codes & 0xff;
+  text->buf[text->len++] = codes >> 8;
+  for (int stage = F; stage < NUM_STAGES; ++stage) {
+    if ((codes >> (2 * stage) & 3) == LATCH_NEW) {
+      text->buf[text->len++] = latch[stage].busy | latch[stage].stalled << 1;
+      put_varint(text, zigzag(latch[stage].pc - 4000LL));
+      text->buf[text->len++] = latch[stage].op;
+      text->buf[text->len++] = latch[stage].rd;
+      text->buf[text->len++] = latch[stage].rs1;
+      text->buf[text->len++] = latch[stage].rs2;
+      put_varint(text, zigzag(latch[stage].imm));
+    }
+  }
+  memcpy(trace->last_latch, latch, sizeof(latch));
+  trace->last_clock = record->clock;
+}
+
+static void*
+trace_writer(void* arg)
+{
+  APEX_Trace* trace = arg;
+  Trace_Text* text = &trace->text;
+
+  pthread_mutex_lock(&trace->lock);
+  while (1) {
+    while (trace->tail == trace->published && !trace->stop) {
+      pthread_cond_wait(&trace->cond, &trace->lock);
+    }
+    if (trace->tail == trace->published) {
+      break;
+    }
+    long long first = trace->tail;
+    long long last = trace->published;
+    pthread_mutex_unlock(&trace->lock);
+
+    for (long long i = first; i < last; ++i) {
+      const APEX_Trace_Record* record = &trace->records[i % TRACE_RECORDS];
+      if (trace->binary) {
+        encode_record(trace, text, record);
+      }
+      else {
+        print_record(text, record, trace->pc_low, trace->pc_high);
+      }
+    }
+    fwrite(text->buf, 1, text->len, text->out);
+    text->len = 0;
+
+    pthread_mutex_lock(&trace->lock);
+    trace->tail = last;
+    pthread_cond_broadcast(&trace->cond);
+  }
+  pthread_mutex_unlock(&trace->lock);
+  return NULL;
+}
+
+/*
+ * Starts a trace writer for cpu, printing to config.out.
+ *
+ * Returns 0 on success, -1 if the writer could not be started
+ */
+static int
+trace_open(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = calloc(1, sizeof(*trace));
+  if (!trace) {
+    return -1;
+  }
+  trace->text.out = cpu->config.out;
+  if (cpu->config.trace_file) {
+    unsigned int version = APEX_TRACE_VERSION;
+    trace->binary = 1;
+    trace->text.out = fopen(cpu->config.trace_file, "wb");
+    if (!trace->text.out) {
+      free(trace);
+      return -1;
+    }
+    fwrite(APEX_TRACE_MAGIC, 1, 4, trace->text.out);
+    fwrite(&version, sizeof(version), 1, trace->text.out);
+  }
+  trace->pc_low = cpu->config.trace_pc_low;
+  trace->pc_high = cpu->config.trace_pc_high > 0 ? cpu->config.trace_pc_high
+                                                 : INT_MAX;
+  pthread_mutex_init(&trace->lock, NULL);
+  pthread_cond_init(&trace->cond, NULL);
+  if (pthread_create(&trace->thread, NULL, trace_writer, trace) != 0) {
+    pthread_cond_destroy(&trace->cond);
+    pthread_mutex_destroy(&trace->lock);
+    if (trace->binary) {
+      fclose(trace->text.out);
+    }
+    free(trace);
+    return -1;
+  }
+  cpu->trace_writer = trace;
+  return 0;
+}
+
+/* Hands every filled record to the writer */
+static void
+trace_publish(APEX_Trace* trace)
+{
+  pthread_mutex_lock(&trace->lock);
+  trace->published = trace->head;
+  trace->tail_seen = trace->tail;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+}
+
+/*
+ * Starts the record of the current cycle, if it lies in the traced cycle
+ * window. Stage latches are then copied in by APEX_trace_stage.
+ */
+void
+APEX_trace_begin_cycle(APEX_CPU* cpu)
+{
+  cpu->trace_record = NULL;
+  if (cpu->clock < cpu->config.trace_first ||
+      (cpu->config.trace_last > 0 && cpu->clock > cpu->config.trace_last)) {
+    return;
+  }
+  if (!cpu->trace_writer && trace_open(cpu) != 0) {
+    if (cpu->config.err) {
+      fprintf(cpu->config.err,
+              "APEX_Error : Unable to start the trace writer\n");
+    }
+    cpu->config.trace = 0;
+    return;
+  }
+
+  APEX_Trace* trace = cpu->trace_writer;
+  if (trace->head - trace->tail_seen == TRACE_RECORDS) {
+    /* Ring full, wait for the writer to free a batch */
+    pthread_mutex_lock(&trace->lock);
+    trace->published = trace->head;
+    pthread_cond_broadcast(&trace->cond);
+    while (trace->head - trace->tail == TRACE_RECORDS) {
+      pthread_cond_wait(&trace->cond, &trace->lock);
+    }
+    trace->tail_seen = trace->tail;
+    pthread_mutex_unlock(&trace->lock);
+  }
+  cpu->trace_record = &trace->records[trace->head % TRACE_RECORDS];
+  cpu->trace_record->clock = cpu->clock;
+}
+
+/* Completes the record started by APEX_trace_begin_cycle */
+void
+APEX_trace_end_cycle(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace_writer;
+  if (!cpu->trace_record) {
+    return;
+  }
+  cpu->trace_record = NULL;
+  if (++trace->head - trace->published >= TRACE_BATCH) {
+    trace_publish(trace);
+  }
+}
+
+/* Copies the latch of stage into the record of the current cycle */
+void
+APEX_trace_stage(APEX_CPU* cpu, int stage)
+{
+  if (cpu->trace_record) {
+    const CPU_Stage* from = &cpu->stage[stage];
+    Trace_Latch* latch = &cpu->trace_record->stage[stage];
+    latch->pc = from->pc;
+    latch->imm = from->imm;
+    latch->op = from->op;
+    latch->rd = from->rd;
+    latch->rs1 = from->rs1;
+    latch->rs2 = from->rs2;
+    latch->busy = from->busy;
+    latch->stalled = from->stalled;
+    latch->unused = 0;
+  }
+}
+
+/*
+ * Waits until all trace output recorded so far has been written, so that
+ * other output to config.out can follow it
+ */
+void
+APEX_trace_flush(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace_writer;
+  if (!trace) {
+    return;
+  }
+  pthread_mutex_lock(&trace->lock);
+  trace->published = trace->head;
+  pthread_cond_broadcast(&trace->cond);
+  while (trace->tail != trace->head) {
+    pthread_cond_wait(&trace->cond, &trace->lock);
+  }
+  trace->tail_seen = trace->tail;
+  pthread_mutex_unlock(&trace->lock);
+}
+
+/* Flushes and stops the trace writer of cpu */
+void
+APEX_trace_close(APEX_CPU* cpu)
+{
+  APEX_Trace* trace = cpu->trace_writer;
+  if (!trace) {
+    return;
+  }
+  pthread_mutex_lock(&trace->lock);
+  trace->published = trace->head;
+  trace->stop = 1;
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->lock);
+  pthread_join(trace->thread, NULL);
+  if (trace->binary && fclose(trace->text.out) != 0 && cpu->config.err) {
+    fprintf(cpu->config.err, "APEX_Error : Unable to write trace %s\n",
+            cpu->config.trace_file);
+  }
+  pthread_cond_destroy(&trace->cond);
+  pthread_mutex_destroy(&trace->lock);
+  free(trace);
+  cpu->trace_writer = NULL;
+  cpu->trace_record = NULL;
+}
+
+static int
+get_varint(FILE* in, unsigned long long* value)
+{
+  int c;
+  int shift = 0;
+  *value = 0;
+  do {
+    if ((c = getc(in)) == EOF || shift > 63) {
+      return -1;
+    }
+    *value |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return 0;
+}
+
+/* Reads the next entry of a binary trace into record, which must hold the
+ * previous entry. Returns 1 on success, 0 at the end of the trace and -1
+ * if the trace is malformed */
+static int
+decode_record(FILE* in, APEX_Trace_Record* record)
+{
+  unsigned long long delta;
+  int c = getc(in);
+  if (c == EOF) {
+    return 0;
+  }
+  ungetc(c, in);
+  int lo, hi;
+  if (get_varint(in, &delta) != 0 || (lo = getc(in)) == EOF ||
+      (hi = getc(in)) == EOF) {
+    return -1;
+  }
+  unsigned int codes = lo | hi << 8;
+
+  Trace_Latch last[NUM_STAGES];
+  memcpy(last, record->stage, sizeof(last));
+  record->clock += delta;
+  for (int stage = F; stage < NUM_STAGES; ++stage) {
+    unsigned char fields[5];
+    unsigned long long pc, imm;
+    Trace_Latch* latch = &record->stage[stage];
+    switch (codes >> (2 * stage) & 3) {
+      case LATCH_SAME:
+        break;
+
+      case LATCH_ADVANCED:
+        if (stage == F) {
+          return -1;
+        }
+        *latch = last[stage - 1];
+        break;
+
+      case LATCH_NEW:
+        if ((c = getc(in)) == EOF || get_varint(in, &pc) != 0 ||
+            fread(fields, 1, 4, in) != 4 || get_varint(in, &imm) != 0) {
+          return -1;
+        }
+        memset(latch, 0, sizeof(*latch));
+        latch->busy = c & 1;
+        latch->stalled = (c >> 1) & 1;
+        latch->pc = unzigzag(pc) + 4000;
+        latch->op = fields[0];
+        latch->rd = fields[1];
+        latch->rs1 = fields[2];
+        latch->rs2 = fields[3];
+        latch->imm = unzigzag(imm);
+        break;
+
+      case LATCH_HIDDEN:
+        hidden_latch(latch);
+        break;
+    }
+  }
+  return 1;
+}
+
+/*
+ * Prints the binary trace read from in to out, as the text display mode
+ * prints or, with csv set, as one CSV row per stage and cycle.
+ *
+ * Returns 0 on success, -1 if in is not a valid trace
+ */
+int
+APEX_trace_decode(FILE* in, FILE* out, int csv)
+{
+  char magic[4];
+  unsigned int version;
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+      memcmp(magic, APEX_TRACE_MAGIC, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, in) != 1 ||
+      version != APEX_TRACE_VERSION) {
+    return -1;
+  }
+
+  Trace_Text* text = calloc(1, sizeof(*text));
+  APEX_Trace_Record record;
+  if (!text) {
+    return -1;
+  }
+  text->out = out;
+  memset(&record, 0, sizeof(record));
+  if (csv) {
+    put_str(text, "cycle,stage,pc,opcode,rd,rs1,rs2,imm,busy,stalled\n");
+  }
+
+  int status;
+  while ((status = decode_record(in, &record)) == 1) {
+    if (csv) {
+      print_record_csv(text, &record);
+    }
+    else {
+      print_record(text, &record, 0, INT_MAX);
+    }
+  }
+  fwrite(text->buf, 1, text->len, out);
+  free(text);
+  return status;
+}